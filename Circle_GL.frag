@@ -0,0 +1,26 @@
+#version 330 core
+
+// Position inside the quad, the circle edge is at distance 1
+in vec2 local;
+in vec3 fragColor;
+
+// 1 keeps only the upper half (local.y >= 0)
+uniform float semicircle;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Signed distance to the edge, negative inside
+    float d = length(local) - 1.0;
+    if (semicircle > 0.5)
+        d = max(d, -local.y);
+
+    // Cover one pixel across the edge, whatever the zoom
+    float w = fwidth(d);
+    float alpha = clamp(0.5 - d / w, 0.0, 1.0);
+    if (alpha <= 0.0)
+        discard;
+    color = vec4(fragColor, alpha);
+}
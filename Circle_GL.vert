@@ -0,0 +1,21 @@
+#version 330 core
+
+// input data : a quad around the origin, in units of the radius
+layout (location = 0) in vec2 quadPosition;
+// flat color, set per draw as the current value of attribute 1
+layout (location = 1) in vec3 vertexColor;
+
+uniform mat4 MVP; // includes the scale by the radius
+
+// output data : used by fragment shader
+out vec2 local;
+out vec3 fragColor;
+
+void main ()
+{
+    local = quadPosition;
+    fragColor = vertexColor;
+
+    // Output position of the vertex, in clip space : MVP * position
+    gl_Position = MVP * vec4(quadPosition, 0, 1);
+}
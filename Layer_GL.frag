@@ -0,0 +1,17 @@
+#version 330 core
+
+// A layer rendered earlier at the size of the viewport
+uniform sampler2D layerColor;
+uniform sampler2D layerDepth;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Copy the layer pixel for pixel, depth included, so later draws
+    // are ordered against it as if it had been drawn this frame
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    color = texelFetch(layerColor, p, 0);
+    gl_FragDepth = texelFetch(layerDepth, p, 0).r;
+}
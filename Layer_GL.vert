@@ -0,0 +1,9 @@
+#version 330 core
+
+// A quad covering the whole viewport, made from gl_VertexID alone:
+// draw 4 vertices as a triangle strip with an empty VAO bound
+void main ()
+{
+    vec2 p = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    gl_Position = vec4(p, 0, 1);
+}
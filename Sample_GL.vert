@@ -4,14 +4,55 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
+// per-instance placement, used by the instanced renderers.
+// Ordinary draws leave these arrays disabled, so the current values apply:
+// offset (0,0), angle 0 and scale (1,1) (set once in initGL) leave the vertex unchanged
+layout (location = 2) in vec2 instanceOffset;
+layout (location = 3) in vec2 instanceScale;
+layout (location = 4) in float instanceAngle; // degrees, counter-clockwise
+
+// Variant for --gpu-falling: instanceOffset.y is the height of the brick at tick
+// instanceFall.x, and it falls instanceFall.y per tick from there (0: not at all).
+// fallTicks has a fraction between ticks; FALL_DROP is the extra drop per tick
+#ifdef GPU_FALLING
+layout (location = 5) in vec2 instanceFall;
+uniform float fallTicks;
+#endif
+
 uniform mat4 MVP;
 
+// Variant for objects stored with normalized int16 positions: LoadShaders
+// defines INT16_POSITIONS and POSITION_RANGE, the value positions were divided by
+#ifdef INT16_POSITIONS
+const float positionScale = POSITION_RANGE;
+#else
+const float positionScale = 1.0;
+#endif
+
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec2 offset = instanceOffset;
+#ifdef GPU_FALLING
+    // the same sum as the CPU (the --gpu-falling loop of fallBricks in
+    // h.cpp; keep the two in step): the speed every tick,
+    // and FALL_DROP more on every tick that ends below -2.2. A brick placed
+    // after the tick being drawn is shown where it was placed
+    if (instanceFall.y > 0.0) {
+        float k = max(0.0, fallTicks - instanceFall.x);
+        float firstDrop = max(1.0, ceil((offset.y + 2.2) / instanceFall.y));
+        offset.y -= k*instanceFall.y + FALL_DROP*max(0.0, k - firstDrop + 1.0);
+    }
+#endif
+
+    // scale, rotate about the mesh origin, then move to the instance position
+    vec2 p = vertexPosition.xy * positionScale * instanceScale;
+    float c = cos(radians(instanceAngle));
+    float s = sin(radians(instanceAngle));
+    p = vec2(c*p.x - s*p.y, s*p.x + c*p.y) + offset;
+    vec4 v = vec4(p, vertexPosition.z, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
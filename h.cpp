@@ -4,9 +4,30 @@
 #include <vector>
 #include <ctime>
 #include <list>
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+#include <dlfcn.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+// only the types: libEGL is opened at run time, see loadEGL
+#define EGL_EGL_PROTOTYPES 0
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -17,12 +38,14 @@ using namespace std;
 
 struct VAO {
     GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLuint VertexBuffer;   // interleaved positions and colors
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    bool Int16Positions;   // drawn with the INT16_POSITIONS shader variant
+    vector<GLfloat> positions; // x,y per vertex, kept for --software
+    vector<GLfloat> colors;    // R,G,B per vertex; empty for createMesh meshes
 };
 typedef struct VAO VAO;
 
@@ -33,82 +56,865 @@ struct GLMatrices {
 	GLuint MatrixID;
 } Matrices;
 
+// View * Projection for the frame being drawn, set at the top of draw()
+glm::mat4 VP;
+
+/* Counts GL object creation and buffer uploads, so we can check that
+   steady-state frames do not allocate anything on the GPU */
+struct GLStats {
+    long objectsCreated;   // glGenVertexArrays + glGenBuffers
+    long bufferUploads;    // glBufferData
+    long drawCalls;
+    long framesDrawn;
+    long allocatingFrames; // frames after the first that created or uploaded anything
+    long brickBytes;       // brick instance data sent to the GPU
+    long visible, culled;  // inView results
+    long drawCommands;     // queued on the draw lists
+    long changesUnsorted;  // program/VAO/fill switches in the order queued
+    long changesSorted;    // and in the order submitted
+    long matrixMultiplies; // taken by the transform cache and the camera
+    long mapFailures;      // glMapBufferRange returned NULL: that draw was skipped
+} glstats;
+
 GLuint programID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* Variant of Sample_GL.vert for objects stored with int16 positions (--int16-vertices) */
+GLuint int16ProgramID;
+bool int16Vertices = false;
+// int16 positions are stored divided by this, so they cover -8..8 in world units
+#define POSITION_RANGE 8.0f
+
+/* Variant of Sample_GL.vert that moves the bricks itself (--gpu-falling) */
+GLuint fallingProgramID;
+GLint fallTicksID; // "fallTicks" uniform
+bool gpuFalling = false;
+
+// Simulated time per headless frame, unless --headless-rate says otherwise
+#define HEADLESS_STEP (1/60.0)
+
+/* --headless: no window, draw() renders into an offscreen framebuffer on a
+   surfaceless EGL context. The clock then advances a fixed step per frame and
+   the bricks are seeded from it, so every run draws the same frames */
+struct Headless {
+    bool enabled;
+    long frames;            // frames to draw before quitting (--frames)
+    double step;            // simulated seconds per frame (--headless-rate)
+    long frame;             // frames drawn so far
+    const char* dumpPath;   // --dump: write the last frame here as a PPM
+    const char* goldenPath; // --golden: compare the last frame with this PPM
+    int width, height;
+    EGLDisplay display;
+    EGLConfig config;
+    EGLContext context;
+    GLuint Framebuffer;
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
+    double renderSeconds;   // draw() up to glFinish, summed over the frames
+} headless = {false, 600, HEADLESS_STEP};
+
+/* The libEGL functions --headless uses. loadEGL looks them up only when
+   --headless is given, so the windowed game needs no libEGL to build or run */
+struct EGLEntryPoints {
+    PFNEGLGETPROCADDRESSPROC GetProcAddress;
+    PFNEGLGETDISPLAYPROC GetDisplay;
+    PFNEGLINITIALIZEPROC Initialize;
+    PFNEGLBINDAPIPROC BindAPI;
+    PFNEGLCHOOSECONFIGPROC ChooseConfig;
+    PFNEGLCREATECONTEXTPROC CreateContext;
+    PFNEGLMAKECURRENTPROC MakeCurrent;
+    PFNEGLDESTROYCONTEXTPROC DestroyContext;
+} egl;
+
+// Largest per-channel difference from the golden image that still passes
+#define GOLDEN_TOLERANCE 2
+
+/* The framebuffer draw() renders to: the window's, or the headless one */
+GLuint screenFramebuffer = 0;
+
+/* Seconds since start, simulated when headless */
+double gameClock()
+{
+    if(headless.enabled)
+        return headless.frame * headless.step;
+    return glfwGetTime();
+}
+
+/* Fixed timestep: the game advances in ticks of sim.step, as many per frame
+   as the clock moved since the last one, so its speed and every collision
+   check are the same at any frame rate. The per-tick steps were tuned on
+   60 Hz displays; --tick-rate runs fewer or more ticks and perTick scales
+   the steps to match */
+#define SIM_RATE 60
+// Most ticks per frame; when a frame needs more the game slows down instead
+// of spiralling into ever longer frames that need ever more ticks
+#define SIM_MAX_TICKS 8
+
+struct Simulation {
+    double step;            // seconds per tick (--tick-rate)
+    double accumulator;     // clock time not yet simulated
+    double lastClock;
+    long ticks;
+    long frames;
+    int mostTicks;          // in one frame
+    long clampedFrames;     // frames that hit SIM_MAX_TICKS
+    double droppedSeconds;  // clock time thrown away by the clamp
+} sim = {1.0/SIM_RATE};
+
+// Seconds of game time, sim.step per tick
+double current_time;
+
+/* A step tuned for SIM_RATE ticks a second, scaled to the tick length */
+double perTick(double distance)
+{
+    return distance*(sim.step*SIM_RATE);
+}
+
+/* Seed for the brick generator: the wall clock in seconds, or the game time */
+unsigned randomSeed()
+{
+    if(headless.enabled)
+        return (unsigned)current_time;
+    return time(NULL);
+}
+
+/* Monotonic wall clock in seconds, for timings */
+double wallClock ()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Sounds are skipped when headless: there is nobody to hear them and they
+   would only add noise to the timings */
+void playSound(const char* command)
+{
+    if(!headless.enabled)
+        system(command);
+}
+
+/* Frame pacing (--pacing, --fps-cap): vsync waits in glfwSwapBuffers,
+   adaptive vsync lets a late frame tear instead of waiting a whole extra
+   refresh, a cap waits on the wall clock and uncapped does not wait at all.
+   The cap sleeps in short slices while it is well ahead of the deadline and
+   spins through the last stretch, where the scheduler is too coarse; the
+   spin margin follows the sleep overshoot actually observed */
+enum PacingMode { PACE_VSYNC, PACE_ADAPTIVE, PACE_CAP, PACE_UNCAPPED };
+const char* pacingNames[] = { "vsync", "adaptive", "cap", "uncapped" };
+// Length of one sleep slice while waiting for the cap deadline
+#define PACING_SLICE 0.001
+// Frame intervals are histogrammed in 0.1 ms buckets up to this many
+#define PACING_BUCKETS 1000
+
+struct Pacing {
+    PacingMode mode;
+    bool modeSet;           // --pacing given; otherwise headless runs are uncapped
+    double capHz;           // --fps-cap
+    double deadline;        // wall clock the next capped frame is due
+    double last;            // wall clock the previous frame was finished
+    double spinMargin;      // time before the deadline from which we spin
+    double sleepMean, sleepM2; // sleep slice lengths, for the spin margin
+    long sleeps;
+    double sleepSeconds, spinSeconds;
+    long frames;            // frame intervals recorded
+    double mean, m2;        // running mean and sum of squared deviations
+    double minimum, maximum;
+    long late;              // capped frames that finished after their deadline
+    long histogram[PACING_BUCKETS+1];
+} pacing = {PACE_VSYNC, false, 60, 0, 0, 0.002};
+
+/* Swap interval for the window; adaptive vsync needs the tear extension */
+void applyPacing ()
+{
+    if(pacing.mode == PACE_ADAPTIVE && !glfwExtensionSupported("GLX_EXT_swap_control_tear")
+       && !glfwExtensionSupported("WGL_EXT_swap_control_tear"))
+    {
+        fprintf(stderr, "Adaptive vsync is not supported here, using vsync\n");
+        pacing.mode = PACE_VSYNC;
+    }
+    if(pacing.mode == PACE_VSYNC)
+        glfwSwapInterval(1);
+    else if(pacing.mode == PACE_ADAPTIVE)
+        glfwSwapInterval(-1);
+    else
+        glfwSwapInterval(0);
+}
+
+/* Sleeps until close to the cap deadline, then spins up to it */
+void waitForDeadline ()
+{
+    double now = wallClock();
+    while(pacing.deadline - now > pacing.spinMargin + PACING_SLICE)
+    {
+        this_thread::sleep_for(chrono::microseconds((long)(PACING_SLICE*1e6)));
+        double woke = wallClock();
+        double slept = woke - now;
+        pacing.sleepSeconds += slept;
+        pacing.sleeps++;
+        double delta = slept - pacing.sleepMean;
+        pacing.sleepMean += delta / pacing.sleeps;
+        pacing.sleepM2 += delta * (slept - pacing.sleepMean);
+        // Spin through whatever a slice may oversleep, with some slack for outliers
+        double deviation = pacing.sleeps > 1 ? sqrt(pacing.sleepM2 / (pacing.sleeps-1)) : 0;
+        pacing.spinMargin = max(0.0002, pacing.sleepMean - PACING_SLICE + 3*deviation);
+        now = woke;
+    }
+    double spinStart = now;
+    while(now < pacing.deadline)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#endif
+        now = wallClock();
+    }
+    pacing.spinSeconds += now - spinStart;
+}
+
+/* Called once the frame is presented: waits out the cap and records the
+   interval since the previous frame */
+void paceFrame ()
+{
+    if(pacing.mode == PACE_CAP)
+    {
+        double interval = 1 / pacing.capHz;
+        double now = wallClock();
+        if(pacing.deadline > 0 && now > pacing.deadline)
+            pacing.late++;
+        // A late frame moves the schedule instead of being made up with a
+        // short one, which would only show up as more jitter
+        if(pacing.deadline == 0 || now > pacing.deadline)
+            pacing.deadline = now;
+        else
+            waitForDeadline();
+        pacing.deadline += interval;
+    }
+    double now = wallClock();
+    if(pacing.last > 0)
+    {
+        double interval = now - pacing.last;
+        pacing.frames++;
+        double delta = interval - pacing.mean;
+        pacing.mean += delta / pacing.frames;
+        pacing.m2 += delta * (interval - pacing.mean);
+        if(pacing.frames == 1 || interval < pacing.minimum)
+            pacing.minimum = interval;
+        if(interval > pacing.maximum)
+            pacing.maximum = interval;
+        pacing.histogram[min((long)(interval*10000), (long)PACING_BUCKETS)]++;
+    }
+    pacing.last = now;
+}
+
+/* Frame interval below which the given fraction of frames fall */
+double pacingPercentile (double fraction)
+{
+    long wanted = (long)ceil(fraction * pacing.frames), seen = 0;
+    for(int i=0; i<=PACING_BUCKETS; i++)
+    {
+        seen += pacing.histogram[i];
+        if(seen >= wanted)
+            return (i+1) / 10000.0;
+    }
+    return pacing.maximum;
+}
+
+void printPacingStats ()
+{
+    if(pacing.frames < 2)
+        return;
+    printf("Pacing: %s", pacingNames[pacing.mode]);
+    if(pacing.mode == PACE_CAP)
+        printf(" at %.1f Hz", pacing.capHz);
+    printf(", %ld frames, %.3f ms mean interval (%.1f fps)\n", pacing.frames, 1000*pacing.mean, 1/pacing.mean);
+    printf("Frame jitter: %.3f ms standard deviation, %.3f ms min, %.3f ms max, %.1f ms 99th percentile\n",
+           1000*sqrt(pacing.m2 / (pacing.frames-1)), 1000*pacing.minimum, 1000*pacing.maximum, 1000*pacingPercentile(0.99));
+    if(pacing.mode == PACE_CAP)
+        printf("Cap wait: %.1f ms slept, %.1f ms spun per frame (spin margin %.3f ms), %ld late frames\n",
+               1000*pacing.sleepSeconds / pacing.frames, 1000*pacing.spinSeconds / pacing.frames,
+               1000*pacing.spinMargin, pacing.late);
+}
+
+/* Draw lists are rasterized on the CPU (--software) */
+bool softwareRender = false;
+
+/* Circle_GL.vert/.frag: circles drawn as one quad with the edge found per fragment */
+GLuint circleProgramID;
+GLint circleSemicircleID; // "semicircle" uniform
+
+/* MVP uniform of a program and the matrix last uploaded to it */
+struct ProgramUniforms {
+    GLuint ProgramID;
+    GLint MatrixID;
+    glm::mat4 mvp;
+    bool mvpValid;
+};
+
+#define MAX_PROGRAMS 8
+ProgramUniforms programUniforms[MAX_PROGRAMS];
+int numPrograms;
+
+/* Shadow copy of the GL state touched on every draw. The set* functions only
+   call into GL when the value actually changes; every call saved is counted */
+struct GLState {
+    GLuint program;
+    ProgramUniforms* uniforms; // of the current program
+    GLuint vertexArray;
+    GLuint arrayBuffer;
+    GLenum polygonMode;
+    GLfloat color[3];   // current value of attribute 1
+    int blend;          // GL_BLEND enabled, -1 if unknown
+    long issued;        // calls made this frame
+    long skipped;       // redundant calls dropped this frame
+    long totalIssued;
+    long totalSkipped;
+} glstate;
+
+/* Forget everything, e.g. after code that binds things directly */
+void resetGLState()
+{
+    glstate.program = ~0u;
+    glstate.vertexArray = ~0u;
+    glstate.arrayBuffer = ~0u;
+    glstate.polygonMode = GL_NONE;
+    glstate.uniforms = NULL;
+    glstate.color[0] = -1;
+    glstate.blend = -1;
+    for(int i=0;i<numPrograms;i++)
+        programUniforms[i].mvpValid = false;
+}
+
+/* Make a linked program known to setProgram/setMVP */
+void registerProgram(GLuint program)
+{
+    ProgramUniforms& u = programUniforms[numPrograms++];
+    u.ProgramID = program;
+    u.MatrixID = glGetUniformLocation(program, "MVP");
+    u.mvpValid = false;
+}
+
+/* Fold this frame's counts into the totals */
+void endGLStateFrame()
+{
+    glstate.totalIssued += glstate.issued;
+    glstate.totalSkipped += glstate.skipped;
+    glstate.issued = 0;
+    glstate.skipped = 0;
+}
+
+void setProgram(GLuint program)
+{
+    if(glstate.program == program) { glstate.skipped++; return; }
+    glUseProgram(program);
+    glstate.program = program;
+    glstate.uniforms = NULL;
+    for(int i=0;i<numPrograms;i++)
+        if(programUniforms[i].ProgramID == program)
+            glstate.uniforms = &programUniforms[i];
+    glstate.issued++;
+}
+
+void setVertexArray(GLuint vertexArray)
+{
+    if(glstate.vertexArray == vertexArray) { glstate.skipped++; return; }
+    glBindVertexArray(vertexArray);
+    glstate.vertexArray = vertexArray;
+    glstate.issued++;
+}
+
+void setArrayBuffer(GLuint buffer)
+{
+    if(glstate.arrayBuffer == buffer) { glstate.skipped++; return; }
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glstate.arrayBuffer = buffer;
+    glstate.issued++;
+}
+
+void setPolygonMode(GLenum mode)
+{
+    if(glstate.polygonMode == mode) { glstate.skipped++; return; }
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+    glstate.polygonMode = mode;
+    glstate.issued++;
+}
+
+/* Upload MVP to the current program unless it already holds this matrix */
+void setMVP(const glm::mat4& MVP)
+{
+    ProgramUniforms* u = glstate.uniforms;
+    if(u->mvpValid && u->mvp == MVP) { glstate.skipped++; return; }
+    glUniformMatrix4fv(u->MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    u->mvp = MVP;
+    u->mvpValid = true;
+    glstate.issued++;
+}
+
+void setBlend(bool enable)
+{
+    if(glstate.blend == enable) { glstate.skipped++; return; }
+    if(enable)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
+    glstate.blend = enable;
+    glstate.issued++;
+}
+
+/* Flat color for meshes that have no color array */
+void setColor(GLfloat R, GLfloat G, GLfloat B)
+{
+    if(glstate.color[0] == R && glstate.color[1] == G && glstate.color[2] == B) { glstate.skipped++; return; }
+    glVertexAttrib3f(1, R, G, B);
+    glstate.color[0] = R;
+    glstate.color[1] = G;
+    glstate.color[2] = B;
+    glstate.issued++;
+}
+
+/* Draw lists: the draw helpers queue DrawCommands instead of calling GL, and
+   submitDrawList issues them sorted by a 64-bit key so that draws sharing a
+   program, VAO and fill mode follow each other. The layer sits in the top bits.
+   Everything is drawn at z=0, so of two draws that overlap the later one is on
+   top: they must go in different layers, in the order the game drew them
+   before there were draw lists. Inside a layer draws do not overlap and their
+   order is free */
+enum DrawLayer {
+    LAYER_STATIC,     // bins and mirrors, or the cached static layer
+    LAYER_RIMS,       // bin rims, over the bins
+    LAYER_CANNON,     // cannon base and barrel (the sprite batch)
+    LAYER_CANNON_TIP, // the circle at the end of the barrel
+    LAYER_BRICKS,
+    LAYER_BULLETS,    // over the bricks they hit
+    LAYER_HUD
+};
+
+struct DrawCommand {
+    unsigned char layer;
+    int sequence;       // order queued
+    GLuint program;
+    GLuint vertexArray;
+    GLenum primitive;
+    GLenum fillMode;
+    GLint first;
+    GLsizei count;
+    GLsizei instances;  // 0: not instanced
+    int matrix;         // MVP, index into DrawList::matrices; -1: none
+    GLfloat color[3];   // current value of attribute 1; color[0] < 0: leave it
+    bool blend;
+    GLint uniform;      // one float uniform of the program to set; -1: none
+    GLfloat uniformValue;
+};
+
+struct SortEntry {
+    uint64_t key;
+    int index;
+};
+
+struct DrawList {
+    vector<DrawCommand> commands;
+    vector<glm::mat4> matrices;
+    DrawLayer layer;    // given to the commands queued from now on
+    vector<SortEntry> entries, scratch;
+};
+
+/* frameList is drawn to the screen, layerList into the static layer */
+DrawList frameList, layerList;
+DrawList* drawList = &frameList;
+
+void setDrawLayer(DrawLayer layer)
+{
+    drawList->layer = layer;
+}
+
+/* Queue a draw with default state: no MVP or color, filled, no blending */
+DrawCommand& queueDraw(GLuint program, GLuint vertexArray, GLenum primitive, GLint first, GLsizei count)
+{
+    DrawCommand c;
+    c.layer = drawList->layer;
+    c.sequence = drawList->commands.size();
+    c.program = program;
+    c.vertexArray = vertexArray;
+    c.primitive = primitive;
+    c.fillMode = GL_FILL;
+    c.first = first;
+    c.count = count;
+    c.instances = 0;
+    c.matrix = -1;
+    c.color[0] = -1;
+    c.blend = false;
+    c.uniform = -1;
+    drawList->commands.push_back(c);
+    return drawList->commands.back();
+}
+
+/* Store an MVP for the commands of this list, returns its index */
+int queueMatrix(const glm::mat4& MVP)
+{
+    drawList->matrices.push_back(MVP);
+    return drawList->matrices.size() - 1;
+}
+
+/* layer | program | VAO | fill mode | sequence, most significant first.
+   Most draws, and every HUD draw, use programID: sorting it last in each
+   layer lets its run carry on into the next layer without a switch */
+uint64_t drawKey(const DrawCommand& c)
+{
+    uint64_t program = MAX_PROGRAMS;
+    for(int i=0;i<numPrograms;i++)
+        if(programUniforms[i].ProgramID == c.program)
+            program = i;
+    if(c.program == programID)
+        program = MAX_PROGRAMS + 1;
+    uint64_t fill = c.fillMode == GL_FILL ? 0 : c.fillMode == GL_LINE ? 1 : 2;
+    return (uint64_t)c.layer << 56 | program << 48 | (uint64_t)(c.vertexArray & 0xFFFF) << 32
+           | fill << 30 | (uint64_t)(c.sequence & 0x3FFFFFFF);
+}
+
+/* LSD radix sort on the key, a byte per pass; passes where every key has
+   the same byte are skipped */
+void radixSort(vector<SortEntry>& a, vector<SortEntry>& tmp)
+{
+    tmp.resize(a.size());
+    for(int shift=0; shift<64; shift+=8)
+    {
+        size_t count[257] = {0};
+        for(size_t i=0;i<a.size();i++)
+            count[((a[i].key >> shift) & 0xFF) + 1]++;
+        if(count[((a[0].key >> shift) & 0xFF) + 1] == a.size())
+            continue;
+        for(int b=0;b<256;b++)
+            count[b+1] += count[b];
+        for(size_t i=0;i<a.size();i++)
+            tmp[count[(a[i].key >> shift) & 0xFF]++] = a[i];
+        a.swap(tmp);
+    }
+}
+
+/* Program, VAO and fill mode switches needed to draw in this order */
+long countStateChanges(const DrawList& l, const vector<SortEntry>& order, bool sorted)
+{
+    long changes = 0;
+    const DrawCommand* last = NULL;
+    for(size_t i=0;i<order.size();i++)
+    {
+        const DrawCommand* c = &l.commands[sorted ? order[i].index : i];
+        if(!last || c->program != last->program) changes++;
+        if(!last || c->vertexArray != last->vertexArray) changes++;
+        if(!last || c->fillMode != last->fillMode) changes++;
+        last = c;
+    }
+    return changes;
+}
+
+/* Put the entries of the list in draw order */
+void sortDrawList(DrawList& l)
+{
+    l.entries.resize(l.commands.size());
+    if(l.commands.empty())
+        return;
+    for(size_t i=0;i<l.commands.size();i++)
+    {
+        l.entries[i].key = drawKey(l.commands[i]);
+        l.entries[i].index = i;
+    }
+    glstats.drawCommands += l.commands.size();
+    glstats.changesUnsorted += countStateChanges(l, l.entries, false);
+    radixSort(l.entries, l.scratch);
+    glstats.changesSorted += countStateChanges(l, l.entries, true);
+}
+
+/* Sort and issue everything queued on the list, then empty it */
+void submitDrawList(DrawList& l)
+{
+    if(l.commands.empty())
+        return;
+    sortDrawList(l);
+    for(size_t i=0;i<l.entries.size();i++)
+    {
+        const DrawCommand& c = l.commands[l.entries[i].index];
+        setProgram(c.program);
+        if(c.matrix >= 0)
+            setMVP(l.matrices[c.matrix]);
+        if(c.color[0] >= 0)
+            setColor(c.color[0], c.color[1], c.color[2]);
+        if(c.uniform >= 0)
+            glUniform1f(c.uniform, c.uniformValue);
+        setPolygonMode(c.fillMode);
+        setBlend(c.blend);
+        setVertexArray(c.vertexArray);
+        if(c.instances > 0)
+            glDrawArraysInstanced(c.primitive, c.first, c.count, c.instances);
+        else
+            glDrawArrays(c.primitive, c.first, c.count);
+        glstats.drawCalls++;
+    }
+    l.commands.clear();
+    l.matrices.clear();
+}
+
+/* Program binary cache (--no-shader-cache to bypass): each linked program
+   is saved with glGetProgramBinary to $XDG_CACHE_HOME/shoot or
+   ~/.cache/shoot (--shader-cache DIR for another place), in a file named
+   after a hash of the driver's vendor, renderer and version strings and of
+   the shader sources, and later launches load it with glProgramBinary
+   instead of compiling. The file repeats the driver strings and the source
+   hash, and anything that does not match, or that the driver refuses to
+   load (a driver update can do that), falls back to compiling and replaces
+   the file */
+#define SHADER_CACHE_NAME "shoot"
+#define SHADER_CACHE_MAGIC 0x43504242  // "BBPC"
+
+struct ShaderCache {
+    bool enabled;
+    const char* directory;  // --shader-cache
+    string path;            // where the files are
+    bool checked, supported;
+    string driver;          // vendor, renderer and version
+    long loaded, compiled, stored;
+    double seconds;         // spent in LoadShaders
+} shaderCache = {true};
+
+/* 64-bit FNV-1a */
+uint64_t hashBytes (const char* data, size_t length, uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i=0; i<length; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+/* The cache directory; the XDG base directory spec ignores relative paths */
+string shaderCacheDirectory ()
+{
+    if (shaderCache.directory)
+        return shaderCache.directory;
+    const char* cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome && cacheHome[0] == '/')
+        return string(cacheHome) + "/" SHADER_CACHE_NAME;
+    const char* home = getenv("HOME");
+    if (home && home[0])
+        return string(home) + "/.cache/" SHADER_CACHE_NAME;
+    return "";
+}
+
+/* mkdir -p */
+void makeDirectories (const string& path)
+{
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash+1))
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    mkdir(path.c_str(), 0755);
+}
+
+bool shaderCacheUsable ()
+{
+    if (!shaderCache.checked) {
+        shaderCache.checked = true;
+        GLint formats = 0;
+        if (GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        shaderCache.supported = formats > 0;
+        shaderCache.driver = string((const char*)glGetString(GL_VENDOR)) + "\n" +
+            (const char*)glGetString(GL_RENDERER) + "\n" + (const char*)glGetString(GL_VERSION);
+        if (shaderCache.enabled && !shaderCache.supported)
+            printf("Shader cache: the driver has no program binary formats, compiling every time\n");
+        shaderCache.path = shaderCacheDirectory();
+        if (shaderCache.enabled && shaderCache.supported && shaderCache.path.empty()) {
+            printf("Shader cache: neither XDG_CACHE_HOME nor HOME is set, compiling every time\n");
+            shaderCache.supported = false;
+        }
+    }
+    return shaderCache.enabled && shaderCache.supported;
+}
+
+/* Load a cached program into 'program'; false if there is none that fits */
+bool loadProgramBinary (GLuint program, const char* path, uint64_t sourceHash)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    uint32_t header[3];  // magic, binary format, driver string length
+    uint64_t hash;
+    uint32_t length;
+    string driver;
+    vector<char> binary;
+    bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == SHADER_CACHE_MAGIC
+              && header[2] == shaderCache.driver.size();
+    if (ok) {
+        driver.resize(header[2]);
+        ok = fread(&driver[0], 1, header[2], file) == header[2] && driver == shaderCache.driver
+             && fread(&hash, sizeof(hash), 1, file) == 1 && hash == sourceHash
+             && fread(&length, sizeof(length), 1, file) == 1 && length > 0;
+    }
+    if (ok) {
+        binary.resize(length);
+        ok = fread(&binary[0], 1, length, file) == length;
+    }
+    fclose(file);
+    if (!ok)
+        return false;
+    glProgramBinary(program, header[1], &binary[0], length);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+}
+
+/* Save a linked program; written to a temporary file and renamed, so that
+   another instance never reads half a file */
+void storeProgramBinary (GLuint program, const char* path, uint64_t sourceHash)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, NULL, &format, &binary[0]);
+    makeDirectories(shaderCache.path);
+    string temporary = string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return;
+    uint32_t header[3] = {SHADER_CACHE_MAGIC, format, (uint32_t)shaderCache.driver.size()};
+    uint32_t size = length;
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(shaderCache.driver.data(), 1, shaderCache.driver.size(), file);
+    fwrite(&sourceHash, sizeof(sourceHash), 1, file);
+    fwrite(&size, sizeof(size), 1, file);
+    fwrite(&binary[0], 1, length, file);
+    bool ok = !ferror(file);
+    if (fclose(file) == 0 && ok && rename(temporary.c_str(), path) == 0)
+        shaderCache.stored++;
+    else
+        remove(temporary.c_str());
+}
+
+/* Whole file as a string; empty if it cannot be read */
+std::string readTextFile (const char* path)
+{
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (!stream.is_open()) {
+        fprintf(stderr, "Could not open shader %s\n", path);
+        return "";
+    }
+    return std::string((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+}
+
+/* Shader sources built into the binary by the Makefile (shaders.inc), so
+   the game does not depend on the working directory to find them */
+struct EmbeddedShader {
+    const char* name;
+    const char* source;
+};
+
+constexpr EmbeddedShader embeddedShaders[] = {
+#include "shaders.inc"
+};
+
+/* --shader-dir: read the shaders from this directory instead, to try edits
+   without rebuilding */
+const char* shaderDirectory = NULL;
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+std::string shaderSource (const char* name)
+{
+    if (shaderDirectory)
+        return readTextFile((std::string(shaderDirectory) + "/" + name).c_str());
+    for (const EmbeddedShader& shader : embeddedShaders)
+        if (!strcmp(shader.name, name))
+            return shader.source;
+    // not built in: look in the working directory
+    return readTextFile(name);
+}
+
+/* Compile one shader; the info log is only printed when there is one */
+GLuint compileShader (GLenum type, const std::string& code, const char* path)
+{
+	GLuint ShaderID = glCreateShader(type);
+	char const * SourcePointer = code.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer , NULL);
+	glCompileShader(ShaderID);
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if(InfoLogLength > 1)
 	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		std::vector<char> ShaderErrorMessage(InfoLogLength);
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		fprintf(Result ? stdout : stderr, "%s: %s\n", path, &ShaderErrorMessage[0]);
 	}
+	else if(!Result)
+		fprintf(stderr, "%s: compilation failed\n", path);
+	return ShaderID;
+}
+
+/* Function to load Shaders - Use it as it is */
+/* defines, if given, are inserted after the #version line of both shaders */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path,const char * defines=NULL) {
+	double start = wallClock();
+
+	// Get the shader code, built in or from --shader-dir
+	std::string VertexShaderCode = shaderSource(vertex_file_path);
+	std::string FragmentShaderCode = shaderSource(fragment_file_path);
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+	if(defines)
+	{
+		VertexShaderCode.insert(VertexShaderCode.find('\n', VertexShaderCode.find("#version"))+1, defines);
+		FragmentShaderCode.insert(FragmentShaderCode.find('\n', FragmentShaderCode.find("#version"))+1, defines);
 	}
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
+	GLuint ProgramID = glCreateProgram();
+
+	// Try the cache first
+	bool cached = shaderCacheUsable();
+	char cachePath[1024];
+	uint64_t sourceHash = 0;
+	if(cached)
+	{
+		sourceHash = hashBytes(VertexShaderCode.data(), VertexShaderCode.size());
+		sourceHash = hashBytes("", 1, sourceHash);
+		sourceHash = hashBytes(FragmentShaderCode.data(), FragmentShaderCode.size(), sourceHash);
+		uint64_t key = hashBytes(shaderCache.driver.data(), shaderCache.driver.size(), sourceHash);
+		snprintf(cachePath, sizeof(cachePath), "%s/%016llx.bin", shaderCache.path.c_str(), (unsigned long long)key);
+		if(loadProgramBinary(ProgramID, cachePath, sourceHash))
+		{
+			shaderCache.loaded++;
+			shaderCache.seconds += wallClock() - start;
+			return ProgramID;
+		}
+	}
 
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-	// Compile Fragment Shader
-	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+	GLuint VertexShaderID = compileShader(GL_VERTEX_SHADER, VertexShaderCode, vertex_file_path);
+	GLuint FragmentShaderID = compileShader(GL_FRAGMENT_SHADER, FragmentShaderCode, fragment_file_path);
 
 	// Link the program
-	fprintf(stdout, "Linking program\n");
-	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if(cached)
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
 	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
 	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+	if(InfoLogLength > 1)
+	{
+		std::vector<char> ProgramErrorMessage(InfoLogLength);
+		glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+		fprintf(Result ? stdout : stderr, "Linking %s and %s: %s\n", vertex_file_path, fragment_file_path, &ProgramErrorMessage[0]);
+	}
+	else if(!Result)
+		fprintf(stderr, "Linking %s and %s failed\n", vertex_file_path, fragment_file_path);
 
+	glDetachShader(ProgramID, VertexShaderID);
+	glDetachShader(ProgramID, FragmentShaderID);
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	if(cached && Result)
+		storeProgramBinary(ProgramID, cachePath, sourceHash);
+	shaderCache.compiled++;
+	shaderCache.seconds += wallClock() - start;
 	return ProgramID;
 }
 
@@ -117,88 +923,170 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Esc, q and the close button only end the main loop: the capture is
+   finished and the stats read while the context is still current, and
+   main() terminates GLFW after that */
 void quit(GLFWwindow *window)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
-//    exit(EXIT_SUCCESS);
+    glfwSetWindowShouldClose(window, GLFW_TRUE);
+}
+
+
+/* Interleaved vertex written by create3DObject: 2D position and RGBA8 color */
+struct PackedVertex {
+    GLfloat x, y;
+    GLubyte color[4];
+};
+
+/* The same with positions as normalized int16 (--int16-vertices) */
+struct PackedVertex16 {
+    GLshort x, y;
+    GLubyte color[4];
+};
+
+GLubyte packColor(GLfloat c)
+{
+    return (GLubyte)(glm::clamp(c, 0.0f, 1.0f)*255.0f + 0.5f);
 }
 
+GLshort packPosition(GLfloat p)
+{
+    return (GLshort)glm::clamp(p/POSITION_RANGE*32767.0f + (p < 0 ? -0.5f : 0.5f), -32767.0f, 32767.0f);
+}
+
+/* The VAOs made by create3DObject and createMesh, indexed by VertexArrayID */
+vector<VAO*> objectsByVAO;
+
+void registerObject(VAO* vao)
+{
+    if(vao->VertexArrayID >= objectsByVAO.size())
+        objectsByVAO.resize(vao->VertexArrayID + 1);
+    objectsByVAO[vao->VertexArrayID] = vao;
+}
 
-/* Generate VAO, VBOs and return VAO handle */
+/* Generate VAO, VBO and return VAO handle.
+   Takes x,y,z positions and r,g,b colors; z is dropped and colors are packed to bytes */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->Int16Positions = int16Vertices;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
-
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-                          0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
-
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices and colors
+    glstats.objectsCreated += 2;
+    glstats.bufferUploads += 1;
+
+    setVertexArray (vao->VertexArrayID); // Bind the VAO
+    setArrayBuffer (vao->VertexBuffer); // Bind the VBO
+    if(vao->Int16Positions)
+    {
+        vector<PackedVertex16> vertices(numVertices);
+        for (int i=0; i<numVertices; i++) {
+            vertices[i].x = packPosition(vertex_buffer_data[3*i]);
+            vertices[i].y = packPosition(vertex_buffer_data[3*i + 1]);
+            for (int c=0; c<3; c++)
+                vertices[i].color[c] = packColor(color_buffer_data[3*i + c]);
+            vertices[i].color[3] = 255;
+        }
+        for (int i=0; i<numVertices; i++) {
+            vao->positions.push_back(vertices[i].x/32767.0f*POSITION_RANGE);
+            vao->positions.push_back(vertices[i].y/32767.0f*POSITION_RANGE);
+        }
+        glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(PackedVertex16), &vertices[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex16), (void*)offsetof(PackedVertex16, x));
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedVertex16), (void*)offsetof(PackedVertex16, color));
+    }
+    else
+    {
+        vector<PackedVertex> vertices(numVertices);
+        for (int i=0; i<numVertices; i++) {
+            vertices[i].x = vertex_buffer_data[3*i];
+            vertices[i].y = vertex_buffer_data[3*i + 1];
+            for (int c=0; c<3; c++)
+                vertices[i].color[c] = packColor(color_buffer_data[3*i + c]);
+            vertices[i].color[3] = 255;
+        }
+        for (int i=0; i<numVertices; i++) {
+            vao->positions.push_back(vertices[i].x);
+            vao->positions.push_back(vertices[i].y);
+        }
+        glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(PackedVertex), &vertices[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, x));
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, color));
+    }
+    // Attribute 0 - positions, 1 - colors
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
 
+    // what the shader sees after the colors were packed
+    for (int i=0; i<3*numVertices; i++)
+        vao->colors.push_back(packColor(color_buffer_data[i])/255.0f);
+    registerObject(vao);
     return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+/* Generate VAO, VBO and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    vector<GLfloat> color_buffer_data(3*numVertices);
     for (int i=0; i<numVertices; i++) {
         color_buffer_data [3*i] = red;
         color_buffer_data [3*i + 1] = green;
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Render the VBOs handled by VAO with the given MVP (queued on the draw list) */
+void draw3DObject (struct VAO* vao, const glm::mat4& MVP)
 {
+    // int16 objects need the shader that scales their positions back up
+    GLuint program = vao->Int16Positions ? int16ProgramID : programID;
+
+    // Draw the geometry !
+    DrawCommand& c = queueDraw(program, vao->VertexArrayID, vao->PrimitiveMode, 0, vao->NumVertices);
+    c.matrix = queueMatrix(MVP);
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    c.fillMode = vao->FillMode;
+}
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+/* Generate a position-only VAO, meant to be created once and reused.
+   Takes x,y,z positions like create3DObject and keeps x,y.
+   Attribute 1 (color) is left disabled so each draw can set it with glVertexAttrib3f */
+struct VAO* createMesh (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data)
+{
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = GL_FILL;
+    vao->Int16Positions = false;
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glGenVertexArrays(1, &(vao->VertexArrayID));
+    glGenBuffers (1, &(vao->VertexBuffer));
+    glstats.objectsCreated += 2;
+    glstats.bufferUploads += 1;
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    setVertexArray (vao->VertexArrayID);
+    setArrayBuffer (vao->VertexBuffer);
+    vector<GLfloat> positions(2*numVertices);
+    for (int i=0; i<numVertices; i++) {
+        positions[2*i] = vertex_buffer_data[3*i];
+        positions[2*i + 1] = vertex_buffer_data[3*i + 1];
+    }
+    glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), &positions[0], GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glEnableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    vao->positions = positions;
+    registerObject(vao);
+    return vao;
 }
 
 /**************************
@@ -209,40 +1097,393 @@ float triangle_rot_dir = 1,pan=0,zoom=1,pany=0,blockdist=0.02;
 float rectangle_rot_dir = 1;
 bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
-float binpos[3]={0},brickpos[10005]={0},laserpos[3]={0},brick_width,brick_height,leftbrick[100005][5],rightbrick[100005][5],bullets[10005][5];
-double last_update_time,current_time,fall_down_time,shoot_time,show_time,bullet_update_time,black_create_time;
+float binpos[3]={0},brickpos[10005]={0},laserpos[3]={0},brick_width,brick_height;
+double last_update_time,shoot_time,black_create_time;
 int ctrl=0,alt=0,leftleft=0,leftright=0,rightright=0,rightleft=0,laserup=0,laserdown=0,laserrotup=0,laserrotdown=0,panup=0,pandown=0,score=0;
-int leftstart=0,rightstart=0,panleft=0,panright=0,zoomin=0,zoomout=0,dele[100005],cou=0,leftend=-1,rightend=-1,fire=0,bulletstart=0,bulletend=-1;
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-int leftclick=0,rightclick=0,redbin=0,greenbin=0,canon=0,increasespeed=0,decreasespeed=0,collidedmirror[100005];
-int gameover=0,leftvisit[1000]={0},rightvisit[1000]={0},onlaser=0,pause=0,leftlives=3,rightlives=3;
-double mouse_x,mouse_y;
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+int panleft=0,panright=0,zoomin=0,zoomout=0,dele[100005],cou=0,fire=0;
+
+/* Bullets and bricks live in dense pools: the live ones fill 0..count-1
+   with no gaps, so every loop over them costs as much as there are
+   entities, removing one moves the last into its place, and the arrays grow
+   as needed. Code that has to find an entity again later keeps a Handle,
+   which stops matching once the entity is removed */
+struct Handle {
+  unsigned slot;
+  unsigned generation;
+};
+
+/* Bookkeeping of a pool; its items are in the arrays beside it */
+struct PoolSlots {
+  vector<unsigned> slotOf;      // slot of each item
+  vector<unsigned> itemOf;      // item in each slot
+  vector<unsigned> generation;  // of each slot, bumped when its item is removed
+  vector<unsigned> freeSlots;
+  int peak;                     // most items at once
+};
+
+/* A slot for the item just appended to the pool's vector */
+Handle poolAdd(PoolSlots& p)
 {
-     // Function is called first on GLFW_PRESS.
+  unsigned slot;
+  if(p.freeSlots.empty())
+  {
+    slot = p.generation.size();
+    p.generation.push_back(0);
+    p.itemOf.push_back(0);
+  }
+  else
+  {
+    slot = p.freeSlots.back();
+    p.freeSlots.pop_back();
+  }
+  p.itemOf[slot] = p.slotOf.size();
+  p.slotOf.push_back(slot);
+  p.peak = max(p.peak, (int)p.slotOf.size());
+  Handle h = {slot, p.generation[slot]};
+  return h;
+}
 
-    if (action == GLFW_RELEASE) {
-        switch (key) {
-            case GLFW_KEY_C:
-                rectangle_rot_status = !rectangle_rot_status;
-                break;
-            case GLFW_KEY_P:
-                triangle_rot_status = !triangle_rot_status;
-                break;
-            case GLFW_KEY_X:
-                // do something ..
-                break;
-            default:
-                break;
-        }
-    }
-    else if (action == GLFW_PRESS) {
-        switch (key) {
-            case GLFW_KEY_ESCAPE:
-                quit(window);
-                break;
-            default:
+/* Free the slot of item i; the caller moves its last item to i and pops it */
+void poolRemove(PoolSlots& p, int i)
+{
+  unsigned slot = p.slotOf[i];
+  p.generation[slot]++;
+  p.freeSlots.push_back(slot);
+  p.slotOf[i] = p.slotOf.back();
+  p.itemOf[p.slotOf[i]] = i;
+  p.slotOf.pop_back();
+}
+
+/* Index of the item a handle refers to, -1 once it was removed */
+int poolFind(PoolSlots& p, Handle h)
+{
+  if(h.slot >= p.generation.size() || p.generation[h.slot] != h.generation)
+    return -1;
+  return p.itemOf[h.slot];
+}
+
+/* The pools are stored as structures of arrays: each field has an array of
+   its own, so the per-tick loops read just the fields they use, contiguously,
+   and the compiler can vectorize them. Every array is 32-byte aligned to be
+   read with 8-wide AVX loads */
+#define ENTITY_ALIGN 32
+
+/* An aligned array of capacity entries of size bytes holding the first count of old */
+void* growArray(void* old, int count, int capacity, int size)
+{
+  void* p = NULL;
+  if(posix_memalign(&p, ENTITY_ALIGN, (size_t)capacity*size) != 0)
+  {
+    fprintf(stderr, "Out of memory for %d entities\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+  if(old)
+  {
+    memcpy(p, old, (size_t)count*size);
+    free(old);
+  }
+  return p;
+}
+
+#define GROW(array, count, capacity) \
+  array = (__typeof__(array))growArray(array, count, capacity, sizeof(*array))
+
+struct Bullets {
+  int count, capacity;
+  float *x, *y;           // where each is drawn from, see createInstanceRenderers
+  float *dx, *dy;         // step per tick
+  float *length, *width;
+  float *angle;           // degrees
+  int *mirror;            // the last mirror it bounced off, so it bounces once
+  float *previousX, *previousY;  // before the last tick, for render interpolation
+} bullets;
+PoolSlots bulletSlots;
+
+void growBullets()
+{
+  Bullets& b = bullets;
+  int n = max(64, 2*b.capacity);
+  GROW(b.x, b.count, n);
+  GROW(b.y, b.count, n);
+  GROW(b.dx, b.count, n);
+  GROW(b.dy, b.count, n);
+  GROW(b.length, b.count, n);
+  GROW(b.width, b.count, n);
+  GROW(b.angle, b.count, n);
+  GROW(b.mirror, b.count, n);
+  GROW(b.previousX, b.count, n);
+  GROW(b.previousY, b.count, n);
+  b.capacity = n;
+}
+
+/* Point bullet i at angle degrees */
+void aimBullet(int i, float angle)
+{
+  bullets.angle[i] = angle;
+  bullets.dx[i] = perTick(0.025)*cos(angle*M_PI/180.0f);
+  bullets.dy[i] = perTick(0.025)*sin(angle*M_PI/180.0f);
+}
+
+/* A bullet leaving the cannon at angle degrees */
+Handle spawnBullet(float angle)
+{
+  Bullets& b = bullets;
+  if(b.count == b.capacity)
+    growBullets();
+  int i = b.count++;
+  b.x[i] = -3.375+0.625*cos(angle*M_PI/180.0f);
+  b.y[i] = laserpos[1]+0.75+0.625*sin(angle*M_PI/180.0f);
+  b.length[i] = 0.4;
+  b.width[i] = 0.05;
+  b.mirror[i] = 0;
+  b.previousX[i] = b.x[i];
+  b.previousY[i] = b.y[i];
+  aimBullet(i, angle);
+  return poolAdd(bulletSlots);
+}
+
+void removeBullet(int i)
+{
+  Bullets& b = bullets;
+  poolRemove(bulletSlots, i);
+  int last = --b.count;
+  b.x[i] = b.x[last];
+  b.y[i] = b.y[last];
+  b.dx[i] = b.dx[last];
+  b.dy[i] = b.dy[last];
+  b.length[i] = b.length[last];
+  b.width[i] = b.width[last];
+  b.angle[i] = b.angle[last];
+  b.mirror[i] = b.mirror[last];
+  b.previousX[i] = b.previousX[last];
+  b.previousY[i] = b.previousY[last];
+}
+
+/* --pool-test: bullets are spawned and removed at random, which moves the
+   last one into every gap and hands the freed slots to later bullets. Each
+   handle must still find its own bullet (told apart by angle), and every
+   handle of a removed one must be refused. True if all are */
+bool testPools()
+{
+  const int nSpawned = 2000, nRemoved = 1200;
+  vector<Handle> handles;
+  vector<bool> removed(nSpawned, false);
+  int i, k, found = 0, refused = 0, wrong = 0;
+  srand(2);
+  for(k=0;k<nSpawned;k++)
+  {
+    handles.push_back(spawnBullet(k));
+    // removals in between, so later bullets reuse freed slots
+    if(k%5 == 4)
+      for(int r=0;r<2 && bullets.count>1;r++)
+      {
+        i = rand()%bullets.count;
+        removed[(int)bullets.angle[i]] = true;
+        removeBullet(i);
+      }
+  }
+  while(count(removed.begin(), removed.end(), true) < nRemoved)
+  {
+    i = rand()%bullets.count;
+    removed[(int)bullets.angle[i]] = true;
+    removeBullet(i);
+  }
+  for(k=0;k<nSpawned;k++)
+  {
+    i = poolFind(bulletSlots, handles[k]);
+    if(removed[k])
+      i == -1 ? refused++ : wrong++;
+    else
+      i >= 0 && i < bullets.count && bullets.angle[i] == k ? found++ : wrong++;
+  }
+  printf("Pool test: %d bullets spawned, %d removed, %zu slots; %d found, %d stale handles refused, %d wrong\n",
+         nSpawned, nRemoved, bulletSlots.generation.size(), found, refused, wrong);
+  return wrong == 0;
+}
+
+struct Bricks {
+  int count, capacity;
+  float *x, *y;           // top left corner, y where it is now
+  float *length, *width;
+  int *color;             // 0 black, 1 red, 2 green
+  int *side;              // 0 falls on the left toward the red bin, 1 on the right toward the green one
+  bool *caught;           // scored in a bin already
+  float *baseY;           // --gpu-falling: the height at baseTick,
+  float *baseTick;        // the tick it was placed at
+  float *speed;           // and how far it falls per tick
+  float *previousY;       // before the last tick, for render interpolation
+} bricks;
+PoolSlots brickSlots;
+
+void growBricks()
+{
+  Bricks& b = bricks;
+  int n = max(64, 2*b.capacity);
+  GROW(b.x, b.count, n);
+  GROW(b.y, b.count, n);
+  GROW(b.length, b.count, n);
+  GROW(b.width, b.count, n);
+  GROW(b.color, b.count, n);
+  GROW(b.side, b.count, n);
+  GROW(b.caught, b.count, n);
+  GROW(b.baseY, b.count, n);
+  GROW(b.baseTick, b.count, n);
+  GROW(b.speed, b.count, n);
+  GROW(b.previousY, b.count, n);
+  b.capacity = n;
+}
+
+/* Every matrix product taken by the transform cache and the camera goes through here */
+glm::mat4 mul (const glm::mat4& a, const glm::mat4& b)
+{
+    glstats.matrixMultiplies++;
+    return a * b;
+}
+
+/* The camera only moves with zoom and pan. version is bumped whenever VP
+   changes, so transforms can tell that their MVP is stale */
+struct Camera {
+    bool valid;
+    float zoom, pan, pany;
+    unsigned long version;
+} camera;
+
+/* Recompute the projection and VP, but only when zoom or pan moved */
+void updateCamera ()
+{
+    if(camera.valid && camera.zoom == zoom && camera.pan == pan && camera.pany == pany)
+        return;
+    camera.valid = true;
+    camera.zoom = zoom;
+    camera.pan = pan;
+    camera.pany = pany;
+    Matrices.projection = glm::ortho(-4.0f*zoom+pan, 4.0f*zoom+pan, -4.0f*zoom+pany, 4.0f*zoom+pany, 0.1f, 500.0f);
+    VP = mul(Matrices.projection, Matrices.view);
+    camera.version++;
+}
+
+/* A node of the transform hierarchy. world = parent world * local and
+   mvp = VP * world are both cached; versions tell when they are stale, so
+   nothing is multiplied for a node whose pose, parent and camera stood still */
+struct Transform {
+    Transform* parent;
+    float x, y, angle;           // pose last given to setPose
+    glm::mat4 local;
+    glm::mat4 world;
+    glm::mat4 mvp;
+    bool localChanged;
+    unsigned long version;       // bumped whenever world changes
+    unsigned long parentVersion; // parent version world was computed from
+    unsigned long worldVersion;  // our version mvp was computed from
+    unsigned long cameraVersion; // camera version mvp was computed from
+};
+
+/* Set up a node with a fixed local transform (identity until setPose is used) */
+void initTransform (Transform& t, Transform* parent, const glm::mat4& local = glm::mat4(1.0f))
+{
+    t.parent = parent;
+    t.x = t.y = t.angle = NAN;
+    t.local = local;
+    t.localChanged = true;
+    t.version = 0;
+    t.parentVersion = 0;
+    t.worldVersion = 0;
+    t.cameraVersion = 0;
+}
+
+/* Place a node at (x,y) rotated by angle degrees about z; free when nothing changed */
+void setPose (Transform& t, float x, float y, float angle)
+{
+    if(t.x == x && t.y == y && t.angle == angle)
+        return;
+    t.x = x;
+    t.y = y;
+    t.angle = angle;
+    glm::mat4 translate = glm::translate (glm::vec3(x, y, 0));
+    if(angle == 0)
+        t.local = translate;
+    else
+        t.local = mul(translate, glm::rotate((float)(angle*M_PI/180.0f), glm::vec3(0,0,1)));
+    t.localChanged = true;
+}
+
+const glm::mat4& transformWorld (Transform& t)
+{
+    if(t.parent)
+        transformWorld(*t.parent);
+    if(t.localChanged || (t.parent && t.parent->version != t.parentVersion))
+    {
+        if(t.parent)
+        {
+            t.world = mul(t.parent->world, t.local);
+            t.parentVersion = t.parent->version;
+        }
+        else
+            t.world = t.local;
+        t.localChanged = false;
+        t.version++;
+    }
+    return t.world;
+}
+
+const glm::mat4& transformMVP (Transform& t)
+{
+    transformWorld(t);
+    if(t.worldVersion != t.version || t.cameraVersion != camera.version)
+    {
+        t.mvp = mul(VP, t.world);
+        t.worldVersion = t.version;
+        t.cameraVersion = camera.version;
+    }
+    return t.mvp;
+}
+
+/* Draw a shared mesh placed by a transform, with a flat color */
+void drawMesh (struct VAO* mesh, Transform& t, float R, float G, float B)
+{
+    DrawCommand& c = queueDraw(programID, mesh->VertexArrayID, mesh->PrimitiveMode, 0, mesh->NumVertices);
+    c.matrix = queueMatrix(transformMVP(t));
+    c.color[0] = R;
+    c.color[1] = G;
+    c.color[2] = B;
+    c.fillMode = mesh->FillMode;
+}
+
+/* The cannon, bins and mirrors. [1] is the red bin and [2] the green one, as in binpos */
+Transform cannonBase, cannonBarrel, cannonTip;
+Transform binNode[3], binBody[3], binRim[3];
+Transform mirrorNode[4];
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+int leftclick=0,rightclick=0,redbin=0,greenbin=0,canon=0,increasespeed=0,decreasespeed=0;
+int gameover=0,onlaser=0,pause=0,leftlives=3,rightlives=3;
+double mouse_x,mouse_y;
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+     // Function is called first on GLFW_PRESS.
+
+    if (action == GLFW_RELEASE) {
+        switch (key) {
+            case GLFW_KEY_C:
+                rectangle_rot_status = !rectangle_rot_status;
+                break;
+            case GLFW_KEY_P:
+                triangle_rot_status = !triangle_rot_status;
+                break;
+            case GLFW_KEY_X:
+                // do something ..
+                break;
+            default:
+                break;
+        }
+    }
+    else if (action == GLFW_PRESS) {
+        switch (key) {
+            case GLFW_KEY_ESCAPE:
+                quit(window);
+                break;
+            default:
                 break;
         }
     }
@@ -443,12 +1684,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
           if(angle>=-80 && angle<=80)
           {
           laserpos[2]=angle/5;
-          bulletend=(bulletend+1)%100;
-          bullets[bulletend][0]=-3.375+0.625*cos(angle*M_PI/180.0f);
-          bullets[bulletend][1]=laserpos[1]+0.75+0.625*sin(angle*M_PI/180.0f);
-          bullets[bulletend][2]=0.4;
-          bullets[bulletend][3]=0.05;
-          bullets[bulletend][4]=angle;
+          spawnBullet(angle);
          }
        }
      }
@@ -490,6 +1726,222 @@ void mouseZoom(GLFWwindow* window,double xoffset,double yoffset)
       zoom+=0.01;
   }
 }
+/* Layer compositor: the static layer is rendered into an offscreen colour and
+   depth texture the size of the viewport, and only redrawn when the view or
+   the bins change. Every other frame copies it to the screen with one quad */
+struct StaticLayer {
+  GLuint Framebuffer;
+  GLuint ColorTexture, DepthTexture;
+  GLuint VertexArrayID; // empty, Layer_GL.vert needs no vertex data
+  GLuint ProgramID;
+  int width, height;
+  bool usable;          // framebuffer complete
+  bool valid;           // textures hold the layer for the state below
+  float zoom, pan, pany, redbinpos, greenbinpos;
+  int redbin, greenbin;
+  long renders;
+} staticLayer;
+
+void createStaticLayer()
+{
+  glGenFramebuffers(1, &staticLayer.Framebuffer);
+  glGenTextures(1, &staticLayer.ColorTexture);
+  glGenTextures(1, &staticLayer.DepthTexture);
+  glGenVertexArrays(1, &staticLayer.VertexArrayID);
+  glstats.objectsCreated += 4;
+
+  staticLayer.ProgramID = LoadShaders( "Layer_GL.vert", "Layer_GL.frag" );
+  registerProgram(staticLayer.ProgramID);
+  setProgram(staticLayer.ProgramID);
+  glUniform1i(glGetUniformLocation(staticLayer.ProgramID, "layerColor"), 0);
+  glUniform1i(glGetUniformLocation(staticLayer.ProgramID, "layerDepth"), 1);
+}
+
+/* (Re)allocate the layer for a new framebuffer size */
+void resizeStaticLayer(int width, int height)
+{
+  if(width == staticLayer.width && height == staticLayer.height)
+    return;
+  staticLayer.width = width;
+  staticLayer.height = height;
+  staticLayer.valid = false;
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, staticLayer.ColorTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, staticLayer.DepthTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glstats.bufferUploads += 2;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, staticLayer.Framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, staticLayer.ColorTexture, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, staticLayer.DepthTexture, 0);
+  staticLayer.usable = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  if(!staticLayer.usable)
+    fprintf(stderr, "Static layer framebuffer incomplete, drawing it every frame\n");
+  // the software rasterizer draws it every frame as well
+  if(softwareRender)
+    staticLayer.usable = false;
+  glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+}
+
+/* Dynamic resolution (--render-scale, --target-frame-time): draw() renders
+   into the bottom left corner of a full size framebuffer, percent of the way
+   across in each direction, and presentScaledFrame stretches that corner over
+   the screen. Keeping the buffers at full size means a new scale is only a
+   new viewport. With a target frame time the scale follows the measured
+   frame time; fill cost goes with the area, so the scale moves with the
+   square root of the ratio between the two */
+#define RENDER_SCALE_QUERIES 4   // timer queries in flight, read back this many frames later
+#define RENDER_SCALE_MIN 25
+#define RENDER_SCALE_STEP 5      // percent
+#define RENDER_SCALE_HOLD 30     // frames between changes
+
+struct RenderScale {
+  bool enabled;
+  int percent;
+  double target;        // seconds per frame; 0 keeps the scale fixed
+  GLuint Framebuffer;
+  GLuint ColorBuffer;
+  GLuint DepthBuffer;
+  GLuint Output;        // where the frame is presented
+  int fullWidth, fullHeight;
+  int width, height;    // rendered part
+  GLuint queries[RENDER_SCALE_QUERIES];
+  long frame;
+  double cpuStart;
+  double frameTime;     // smoothed max of CPU and GPU time
+  int held;             // frames since the last change
+  long changes;
+  double percentSum;
+} renderScale = {false, 100};
+
+void createRenderScale()
+{
+  if(!renderScale.enabled)
+    return;
+  glGenFramebuffers(1, &renderScale.Framebuffer);
+  glGenRenderbuffers(1, &renderScale.ColorBuffer);
+  glGenRenderbuffers(1, &renderScale.DepthBuffer);
+  glGenQueries(RENDER_SCALE_QUERIES, renderScale.queries);
+  renderScale.Output = screenFramebuffer;
+  screenFramebuffer = renderScale.Framebuffer;
+}
+
+void setRenderPercent(int percent)
+{
+  renderScale.percent = percent;
+  renderScale.width = max(1, renderScale.fullWidth*percent/100);
+  renderScale.height = max(1, renderScale.fullHeight*percent/100);
+  // rendered for the old viewport
+  staticLayer.valid = false;
+}
+
+/* (Re)allocate the full size buffers for a new framebuffer size */
+void resizeRenderScale(int width, int height)
+{
+  if(!renderScale.enabled || (width == renderScale.fullWidth && height == renderScale.fullHeight))
+    return;
+  renderScale.fullWidth = width;
+  renderScale.fullHeight = height;
+  glBindRenderbuffer(GL_RENDERBUFFER, renderScale.ColorBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderScale.DepthBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glstats.bufferUploads += 2;
+  glBindFramebuffer(GL_FRAMEBUFFER, renderScale.Framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderScale.ColorBuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderScale.DepthBuffer);
+  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+  {
+    fprintf(stderr, "Render scale framebuffer incomplete, rendering at full size\n");
+    screenFramebuffer = renderScale.Output;
+    renderScale.enabled = false;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+  setRenderPercent(renderScale.percent);
+}
+
+/* Start a frame: time it and draw to the scaled part only */
+void beginScaledFrame()
+{
+  if(!renderScale.enabled)
+    return;
+  renderScale.cpuStart = wallClock();
+  // the software rasterizer's time is all CPU time
+  if(!softwareRender)
+  glBeginQuery(GL_TIME_ELAPSED, renderScale.queries[renderScale.frame % RENDER_SCALE_QUERIES]);
+  glBindFramebuffer(GL_FRAMEBUFFER, renderScale.Framebuffer);
+  glViewport(0, 0, renderScale.width, renderScale.height);
+  // glClear and the static layer clear only touch the scaled part too
+  glScissor(0, 0, renderScale.width, renderScale.height);
+  glEnable(GL_SCISSOR_TEST);
+}
+
+/* Stretch the frame over the screen and pick the scale of the next one */
+void presentScaledFrame()
+{
+  if(!renderScale.enabled)
+    return;
+  glDisable(GL_SCISSOR_TEST);
+  int w = renderScale.width, h = renderScale.height;
+  if(w < renderScale.fullWidth && h < renderScale.fullHeight)
+  {
+    // linear filtering reads one texel past the top and right edges: repeat the edge there
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, renderScale.Framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, renderScale.Framebuffer);
+    glBlitFramebuffer(0, h-1, w, h, 0, h, w, h+1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBlitFramebuffer(w-1, 0, w, h+1, w, 0, w+1, h+1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, renderScale.Framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, renderScale.Output);
+  glBlitFramebuffer(0, 0, renderScale.width, renderScale.height, 0, 0, renderScale.fullWidth, renderScale.fullHeight,
+                    GL_COLOR_BUFFER_BIT, renderScale.percent == 100 ? GL_NEAREST : GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, renderScale.Framebuffer);
+  if(!softwareRender)
+  glEndQuery(GL_TIME_ELAPSED);
+
+  // GPU time of an older frame, if it is done, so that nothing waits
+  double time = wallClock() - renderScale.cpuStart;
+  renderScale.frame++;
+  if(!softwareRender && renderScale.frame >= RENDER_SCALE_QUERIES)
+  {
+    GLuint query = renderScale.queries[renderScale.frame % RENDER_SCALE_QUERIES];
+    GLint available = 0;
+    glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if(available)
+    {
+      GLuint64 elapsed;
+      glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+      time = max(time, elapsed*1e-9);
+    }
+  }
+  renderScale.frameTime = renderScale.frameTime > 0 ? 0.9*renderScale.frameTime + 0.1*time : time;
+  renderScale.percentSum += renderScale.percent;
+
+  double target = renderScale.target;
+  if(target <= 0 || ++renderScale.held < RENDER_SCALE_HOLD)
+    return;
+  if(renderScale.frameTime > target || renderScale.frameTime < 0.75*target)
+  {
+    // aim a little under the target
+    double percent = renderScale.percent*sqrt(0.9*target/renderScale.frameTime);
+    int p = (int)(percent/RENDER_SCALE_STEP + 0.5)*RENDER_SCALE_STEP;
+    p = max(RENDER_SCALE_MIN, min(100, p));
+    if(p != renderScale.percent)
+    {
+      setRenderPercent(p);
+      renderScale.changes++;
+      renderScale.held = 0;
+    }
+  }
+}
+
 /* Executed when window is resized to 'width' and 'height' */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
 void reshapeWindow (GLFWwindow* window, int width, int height)
@@ -497,12 +1949,15 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     int fbwidth=width, fbheight=height;
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
      is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    if(window)
+      glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
 	GLfloat fov = 90.0f;
 
 	// sets the viewport of openGL renderer
 	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	resizeStaticLayer (fbwidth, fbheight);
+	resizeRenderScale (fbwidth, fbheight);
 
 	// set the projection matrix as perspective
 	/* glMatrixMode (GL_PROJECTION);
@@ -514,60 +1969,12 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 
     // Ortho projection for 2D views
     Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
+    camera.valid = false;
 }
 
-VAO *triangle, *bin[3],*circle[4],*brick[10005],*laser[3],*semicircle,*mirror[5],*leftside[10005],*rightside[10005],*bullet[10005],*temp,*segment[100005],*lives[7];
-
-void createcircle(int p,float r,float R,float G,float B,float x,float y)
-{
-  GLfloat vertex_buffer_data[9*360],color_buffer_data[9*360];
-  int i;
-  for(i=0;i<360;i++)
-  {
-    vertex_buffer_data[9*i]=x+r*cos(i*M_PI/180.0);
-    vertex_buffer_data[9*i+1]=y+r*sin(i*M_PI/180.0);
-    vertex_buffer_data[9*i+2]=0;
-    vertex_buffer_data[9*i+3]=x+r*cos((i+1)*M_PI/180.0);
-    vertex_buffer_data[9*i+4]=y+r*sin((i+1)*M_PI/180.0);
-    vertex_buffer_data[9*i+5]=0;
-    vertex_buffer_data[9*i+6]=x;
-    vertex_buffer_data[9*i+7]=y;
-    vertex_buffer_data[9*i+8]=0;
-  }
-  for(i=0;i<9*360;i+=3)
-  {
-    color_buffer_data[i]=R;
-    color_buffer_data[i+1]=G;
-    color_buffer_data[i+2]=B;
-  }
- circle[p] = create3DObject(GL_TRIANGLES, 1080, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
-
-
-void createsemicircle(float r,float R,float G,float B)
-{
-  GLfloat vertex_buffer_data[9*360],color_buffer_data[9*360];
-  int i;
-  for(i=0;i<360;i++)
-  {
-    vertex_buffer_data[9*i]=r*cos(i*M_PI/180.0);
-    vertex_buffer_data[9*i+1]=r*sin(i*M_PI/180.0);
-    vertex_buffer_data[9*i+2]=0;
-    vertex_buffer_data[9*i+3]=r*cos((i+1)*M_PI/180.0);
-    vertex_buffer_data[9*i+4]=r*sin((i+1)*M_PI/180.0);
-    vertex_buffer_data[9*i+5]=0;
-    vertex_buffer_data[9*i+6]=0;
-    vertex_buffer_data[9*i+7]=0;
-    vertex_buffer_data[9*i+8]=0;
-  }
-  for(i=0;i<9*360;i+=3)
-  {
-    color_buffer_data[i]=R;
-    color_buffer_data[i+1]=G;
-    color_buffer_data[i+2]=B;
-  }
- semicircle = create3DObject(GL_TRIANGLES, 1080, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
+VAO *triangle,*mirror[5],*temp;
+// Shared unit meshes, scaled and coloured per draw
+VAO *unitRectangle,*circleQuad;
 
 // Creates the rectangle object used in this sample code
 void createRectangle(float x,float y,float length,float width,float R,float G,float B,int flag,int i)
@@ -594,49 +2001,647 @@ void createRectangle(float x,float y,float length,float width,float R,float G,fl
     };
 
   // create3DObject creates and returns a handle to a VAO that can be used later
-  if(flag==1)
-  bin[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else if(flag==2)
-  brick[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else if(flag==3)
-  laser[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else  if(flag==4)
+  if(flag==4)
   mirror[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else if(flag==5)
-  leftside[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else if(flag==6)
-  rightside[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else if(flag==7)
-  bullet[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else if(flag==9)
-  segment[i]=create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
   else
   temp=create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
-void createlives(float x,float y,int i)
+
+/* Unit meshes: a 1x1 rectangle hanging down-right from the origin (same layout
+   as createRectangle) and the quad drawCircle covers a radius 1 circle with */
+void createUnitMeshes()
+{
+  GLfloat rectangle_data [] = {
+    0,-1,0, // vertex 1
+    0,0,0, // vertex 2
+    1,0,0, // vertex 3
+
+    1,0,0, // vertex 3
+    1,-1,0, // vertex 4
+    0,-1,0  // vertex 1
+  };
+  unitRectangle = createMesh(GL_TRIANGLES, 6, rectangle_data);
+
+  // A little larger than the circle so the antialiased edge is not clipped
+  const GLfloat e = 1.1f;
+  GLfloat quad_data [] = {
+    -e,-e,0,
+    e,-e,0,
+    -e,e,0,
+    e,e,0
+  };
+  circleQuad = createMesh(GL_TRIANGLE_STRIP, 4, quad_data);
+}
+
+/* Draw a circle over the unit disc of a transform as a single quad;
+   Circle_GL.frag works out the edge. semicircle keeps only the half above y=0 */
+void drawCircle(Transform& t,float R,float G,float B,bool semicircle=false)
 {
-  float length=0.2,width=0.2,R=1,G=0.2,B=0.6;
-  // GL3 accepts only Triangles. Quads are not supported
-  GLfloat vertex_buffer_data [] = {
-    x,y-width,0, // vertex 1
-    x,y,0, // vertex 2
-    x+length,y,0, // vertex 3
+  DrawCommand& c = queueDraw(circleProgramID, circleQuad->VertexArrayID, circleQuad->PrimitiveMode, 0, circleQuad->NumVertices);
+  c.matrix = queueMatrix(transformMVP(t));
+  c.color[0] = R;
+  c.color[1] = G;
+  c.color[2] = B;
+  c.blend = true;
+  c.uniform = circleSemicircleID;
+  c.uniformValue = semicircle;
+}
 
-    x+length,y,0, // vertex 3
-    x+length,y-width,0, // vertex 4
-    x,y-width,0  // vertex 1
+/* A VAO drawing one mesh many times, fed by a streaming per-instance buffer */
+struct InstanceRenderer {
+  GLuint VertexArrayID;
+  GLuint InstanceBuffer;
+  VAO* mesh;
+  int stride;     // bytes per instance
+  int capacity;   // instances the buffer can hold
+  vector<unsigned char> cpu; // the instances for --software, which needs no GL buffer
+};
+
+/* Per-instance data of the brick renderer: where the unit rectangle goes and its color */
+struct BrickInstance {
+  GLfloat x, y, length, width;
+  GLfloat R, G, B;
+};
+
+/* Per-instance data of the bullet renderer: position and direction in degrees */
+struct BulletInstance {
+  GLfloat x, y, angle;
+};
+
+InstanceRenderer brickRenderer, bulletRenderer;
+VAO *bulletMesh;
+
+/* Create the VAO with the mesh on attribute 0 and the instance buffer bound,
+   ready for the caller to describe its per-instance attributes */
+void createInstanceRenderer(InstanceRenderer& r, VAO* mesh, int stride)
+{
+  r.mesh = mesh;
+  r.stride = stride;
+  r.capacity = 256;
+  glGenVertexArrays(1, &r.VertexArrayID);
+  glGenBuffers(1, &r.InstanceBuffer);
+  glstats.objectsCreated += 2;
+  glstats.bufferUploads += 1;
+
+  setVertexArray(r.VertexArrayID);
+  setArrayBuffer(mesh->VertexBuffer);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glEnableVertexAttribArray(0);
+
+  setArrayBuffer(r.InstanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, r.capacity*stride, NULL, GL_STREAM_DRAW);
+}
+
+void instanceAttrib(GLuint index, int size, int offset, int stride)
+{
+  glVertexAttribPointer(index, size, GL_FLOAT, GL_FALSE, stride, (void*)(size_t)offset);
+  glVertexAttribDivisor(index, 1);
+  glEnableVertexAttribArray(index);
+}
+
+/* Map room for count instances, growing the buffer if needed. Returns NULL for
+   no instances, or if the buffer could not be mapped: nothing is drawn then */
+void* mapInstances(InstanceRenderer& r, int count)
+{
+  if(count==0)
+    return NULL;
+  if(softwareRender)
+  {
+    r.cpu.resize(count*r.stride);
+    return &r.cpu[0];
+  }
+  setArrayBuffer(r.InstanceBuffer);
+  if(count > r.capacity)
+  {
+    while(count > r.capacity)
+      r.capacity *= 2;
+    glBufferData(GL_ARRAY_BUFFER, r.capacity*r.stride, NULL, GL_STREAM_DRAW);
+    glstats.bufferUploads++;
+  }
+  void* p = glMapBufferRange(GL_ARRAY_BUFFER, 0, count*r.stride, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if(p==NULL)
+    glstats.mapFailures++;
+  return p;
+}
+
+/* Unmap the instances written after mapInstances and queue one call drawing them.
+   Returns the command for the caller to add to, NULL if there is nothing to draw */
+DrawCommand* drawInstances(InstanceRenderer& r, int count)
+{
+  if(!softwareRender)
+  {
+    setArrayBuffer(r.InstanceBuffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  if(count == 0)
+    return NULL;
+
+  DrawCommand& c = queueDraw(programID, r.VertexArrayID, r.mesh->PrimitiveMode, 0, r.mesh->NumVertices);
+  c.instances = count;
+  c.matrix = queueMatrix(VP);
+  return &c;
+}
+
+void createInstanceRenderers()
+{
+  int stride = sizeof(BrickInstance);
+  createInstanceRenderer(brickRenderer, unitRectangle, stride);
+  instanceAttrib(2, 2, offsetof(BrickInstance, x), stride);
+  instanceAttrib(3, 2, offsetof(BrickInstance, length), stride);
+  instanceAttrib(1, 3, offsetof(BrickInstance, R), stride);
+
+  // The bullet size is baked into its mesh, so only position and angle are streamed
+  GLfloat bullet_data [] = {
+    0,-0.05,0,
+    0,0,0,
+    0.4,0,0,
+
+    0.4,0,0,
+    0.4,-0.05,0,
+    0,-0.05,0
   };
+  bulletMesh = createMesh(GL_TRIANGLES, 6, bullet_data);
+  stride = sizeof(BulletInstance);
+  createInstanceRenderer(bulletRenderer, bulletMesh, stride);
+  instanceAttrib(2, 2, offsetof(BulletInstance, x), stride);
+  instanceAttrib(4, 1, offsetof(BulletInstance, angle), stride);
+}
 
-    GLfloat color_buffer_data [] = {
-      R,G,B, // color 1
-      R,G,B, // color 2
-      R,G,B, // color 3
+/* Vertex written by the sprite batcher, already in world space */
+struct BatchVertex {
+  GLfloat x, y;
+  GLfloat R, G, B;
+};
 
-      R,G,B, // color 3
-      R,G,B, // color 4
-      R,G,B  // color 1
-    };
-lives[i]=create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+#define BATCH_SECTIONS 3
+#define BATCH_SECTION_VERTICES 16384
+
+/* Streaming batcher for flat coloured quads and triangles. The vertex buffer is
+   a ring of BATCH_SECTIONS frame-sized sections; each frame writes into the next
+   section once the fence of the frame that last used it has signalled, and
+   everything batched in the frame is drawn with one call in batchFlush. Since
+   circles, bricks, bullets and the HUD got renderers of their own, only the
+   cannon base and barrel go through it */
+struct SpriteBatcher {
+  GLuint VertexArrayID;
+  GLuint VertexBuffer;
+  bool persistent;       // whole ring mapped once (GL 4.4 / ARB_buffer_storage)
+  BatchVertex* ring;     // persistent mapping of the ring
+  BatchVertex* write;    // next free vertex in the current section, NULL if it could not be mapped
+  int section;
+  int count;             // vertices queued this frame
+  GLsync fences[BATCH_SECTIONS];
+  long stalls;           // frames that had to wait for the GPU
+  long dropped;          // vertices that did not fit in a section
+} batcher;
+
+void createSpriteBatcher()
+{
+  GLsizeiptr size = BATCH_SECTIONS*BATCH_SECTION_VERTICES*sizeof(BatchVertex);
+  glGenVertexArrays(1, &batcher.VertexArrayID);
+  glGenBuffers(1, &batcher.VertexBuffer);
+  glstats.objectsCreated += 2;
+  glstats.bufferUploads += 1;
+
+  setVertexArray(batcher.VertexArrayID);
+  setArrayBuffer(batcher.VertexBuffer);
+  batcher.persistent = softwareRender || GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+  if(softwareRender)
+  {
+    // only rasterizeDrawList reads it: plain memory, and no fences are ever set
+    batcher.ring = new BatchVertex[BATCH_SECTIONS*BATCH_SECTION_VERTICES];
+  }
+  else if(batcher.persistent)
+  {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+    batcher.ring = (BatchVertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    // the storage still takes per-frame maps if the persistent one fails
+    batcher.persistent = batcher.ring != NULL;
+  }
+  else
+  {
+    // Allocated once; sections are mapped unsynchronized behind the fences
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+    batcher.ring = NULL;
+  }
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (void*)offsetof(BatchVertex, x));
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (void*)offsetof(BatchVertex, R));
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+
+  batcher.section = 0;
+  for(int i=0;i<BATCH_SECTIONS;i++)
+    batcher.fences[i] = 0;
+}
+
+/* Move to the next section of the ring, waiting only if the GPU still reads it */
+void batchBegin()
+{
+  batcher.section = (batcher.section+1)%BATCH_SECTIONS;
+  batcher.count = 0;
+  GLsync fence = batcher.fences[batcher.section];
+  if(fence)
+  {
+    if(glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+    {
+      batcher.stalls++;
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    }
+    glDeleteSync(fence);
+    batcher.fences[batcher.section] = 0;
+  }
+
+  GLintptr offset = batcher.section*BATCH_SECTION_VERTICES;
+  if(batcher.persistent)
+    batcher.write = batcher.ring + offset;
+  else
+  {
+    setArrayBuffer(batcher.VertexBuffer);
+    batcher.write = (BatchVertex*)glMapBufferRange(GL_ARRAY_BUFFER, offset*sizeof(BatchVertex), BATCH_SECTION_VERTICES*sizeof(BatchVertex),
+                                                   GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+    // the batched sprites are skipped this frame
+    if(batcher.write == NULL)
+      glstats.mapFailures++;
+  }
+}
+
+void batchVertex(const glm::mat4& model, float x, float y, float R, float G, float B)
+{
+  glm::vec4 p = model * glm::vec4(x, y, 0, 1);
+  BatchVertex* v = batcher.write++;
+  v->x = p.x;
+  v->y = p.y;
+  v->R = R;
+  v->G = G;
+  v->B = B;
+}
+
+/* Room for n more vertices in this frame's section? */
+bool batchReserve(int n)
+{
+  if(batcher.write == NULL)
+    return false;
+  if(batcher.count + n > BATCH_SECTION_VERTICES)
+  {
+    batcher.dropped += n;
+    return false;
+  }
+  batcher.count += n;
+  return true;
+}
+
+void batchTriangle(float x1,float y1,float x2,float y2,float x3,float y3,float R,float G,float B,const glm::mat4& model)
+{
+  if(!batchReserve(3))
+    return;
+  batchVertex(model, x1, y1, R, G, B);
+  batchVertex(model, x2, y2, R, G, B);
+  batchVertex(model, x3, y3, R, G, B);
+}
+
+/* Queue a rectangle with the same arguments as createRectangle, placed by model */
+void batchRectangle(float x,float y,float length,float width,float R,float G,float B,const glm::mat4& model)
+{
+  if(!batchReserve(6))
+    return;
+  batchVertex(model, x, y-width, R, G, B);
+  batchVertex(model, x, y, R, G, B);
+  batchVertex(model, x+length, y, R, G, B);
+
+  batchVertex(model, x+length, y, R, G, B);
+  batchVertex(model, x+length, y-width, R, G, B);
+  batchVertex(model, x, y-width, R, G, B);
+}
+
+/* Queue everything batched this frame as one draw */
+void batchFlush()
+{
+  if(batcher.write == NULL)
+    return;
+  if(!batcher.persistent)
+  {
+    setArrayBuffer(batcher.VertexBuffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  if(batcher.count > 0)
+  {
+    DrawCommand& c = queueDraw(programID, batcher.VertexArrayID, GL_TRIANGLES, batcher.section*BATCH_SECTION_VERTICES, batcher.count);
+    c.matrix = queueMatrix(VP);
+  }
+}
+
+/* Fence the section once its draw has been submitted */
+void batchFence()
+{
+  batcher.fences[batcher.section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* World rectangle the ortho projection shows this frame, set in draw() */
+struct ViewBounds {
+  float left, right, bottom, top;
+} view;
+
+/* Is any of the box x..x+length, y-width..y (the createRectangle layout) in view?
+   Callers test before building matrices or queueing anything */
+bool inView(float x,float y,float length,float width)
+{
+  if(x > view.right || x+length < view.left || y-width > view.top || y < view.bottom)
+  {
+    glstats.culled++;
+    return false;
+  }
+  glstats.visible++;
+  return true;
+}
+
+BrickInstance* writeBrickInstance(BrickInstance* b,int i,float y)
+{
+  b->x = bricks.x[i];
+  b->y = y;
+  b->length = bricks.length[i];
+  b->width = bricks.width[i];
+  b->R = (bricks.color[i]==1);
+  b->G = (bricks.color[i]==2);
+  b->B = 0;
+  return b+1;
+}
+
+/* --gpu-falling: a brick is uploaded only when it is placed, hit or caught,
+   or moved to another index of the pool, together with the tick it was placed
+   at and its speed. The GPU_FALLING variant of Sample_GL.vert works out how
+   far it has fallen since. Instance i of the renderer is brick i */
+struct BrickFall {
+  GLfloat baseTick;
+  GLfloat speed;    // per tick, 0: not at all
+};
+
+/* Per-instance data of the falling brick renderer */
+struct FallingBrickInstance {
+  BrickInstance brick;
+  BrickFall fall;
+};
+
+InstanceRenderer fallingRenderer;
+long fallTicks;   // simulation ticks so far
+float fallSpeed;  // blockdist the bricks are currently placed with
+
+/* One tick of falling for every brick: blockdist, and 0.4 more on every
+   tick that ends below -2.2 */
+void fallBricks()
+{
+  Bricks& b = bricks;
+  int i;
+  float step = perTick(blockdist);
+  double drop = perTick(0.4);
+  if(!gpuFalling)
+  {
+    for(i=0;i<b.count;i++)
+    {
+      // both worked out and one picked, so the loop has no branch to stop it vectorizing
+      float y = b.y[i]-step;
+      float dropped = y-drop;
+      b.y[i] = y<=-2.2 ? dropped : y;
+    }
+    return;
+  }
+  // the same sum from where each brick was placed; keep in step with Sample_GL.vert
+  float dropf = drop;
+  for(i=0;i<b.count;i++)
+  {
+    float k = fallTicks - b.baseTick[i];
+    float firstDrop = max(1.0f, ceilf((b.baseY[i] + 2.2f) / b.speed[i]));
+    b.y[i] = b.baseY[i] - k*b.speed[i] - dropf*max(0.0f, k - firstDrop + 1);
+  }
+}
+
+FallingBrickInstance fallingInstance(int i)
+{
+  FallingBrickInstance b;
+  writeBrickInstance(&b.brick, i, bricks.baseY[i]);
+  b.fall.baseTick = bricks.baseTick[i];
+  b.fall.speed = bricks.speed[i];
+  return b;
+}
+
+void uploadBrick(int i)
+{
+  FallingBrickInstance b = fallingInstance(i);
+  if(softwareRender)
+  {
+    memcpy(&fallingRenderer.cpu[i*sizeof(b)], &b, sizeof(b));
+    return;
+  }
+  setArrayBuffer(fallingRenderer.InstanceBuffer);
+  glBufferSubData(GL_ARRAY_BUFFER, i*sizeof(b), sizeof(b), &b);
+  glstats.brickBytes += sizeof(b);
+}
+
+/* Make room for every brick in the pool, uploading them all again */
+void growFallingRenderer()
+{
+  InstanceRenderer& r = fallingRenderer;
+  while(bricks.count > r.capacity)
+    r.capacity *= 2;
+  vector<FallingBrickInstance> all(r.capacity);
+  memset(&all[0], 0, all.size()*r.stride);
+  for(int i=0;i<bricks.count;i++)
+    all[i] = fallingInstance(i);
+  if(softwareRender)
+  {
+    r.cpu.assign((unsigned char*)&all[0], (unsigned char*)&all[0] + all.size()*r.stride);
+    return;
+  }
+  setArrayBuffer(r.InstanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, all.size()*r.stride, &all[0], GL_STATIC_DRAW);
+  glstats.bufferUploads++;
+  glstats.brickBytes += bricks.count*r.stride;
+}
+
+/* Put a brick at height y; in --gpu-falling mode it falls on from there */
+void setBrickY(int i, float y)
+{
+  bricks.y[i] = y;
+  bricks.baseY[i] = y;
+  if(gpuFalling)
+  {
+    bricks.baseTick[i] = fallTicks;
+    bricks.speed[i] = perTick(fallSpeed);
+    uploadBrick(i);
+  }
+}
+
+/* A length by width brick with its top left corner at x,y */
+Handle addBrick(int color, int side, float x, float y, float length, float width)
+{
+  Bricks& b = bricks;
+  if(b.count == b.capacity)
+    growBricks();
+  int i = b.count++;
+  b.x[i] = x;
+  b.length[i] = length;
+  b.width[i] = width;
+  b.color[i] = color;
+  b.side[i] = side;
+  b.caught[i] = false;
+  b.previousY[i] = y;
+  if(gpuFalling && b.count > fallingRenderer.capacity)
+    growFallingRenderer();
+  setBrickY(i, y);
+  return poolAdd(brickSlots);
+}
+
+void removeBrick(int i)
+{
+  Bricks& b = bricks;
+  poolRemove(brickSlots, i);
+  int last = --b.count;
+  b.x[i] = b.x[last];
+  b.y[i] = b.y[last];
+  b.length[i] = b.length[last];
+  b.width[i] = b.width[last];
+  b.color[i] = b.color[last];
+  b.side[i] = b.side[last];
+  b.caught[i] = b.caught[last];
+  b.baseY[i] = b.baseY[last];
+  b.baseTick[i] = b.baseTick[last];
+  b.speed[i] = b.speed[last];
+  b.previousY[i] = b.previousY[last];
+  // the instance past the end is no longer drawn, the one moved here is
+  if(gpuFalling && i < b.count)
+    uploadBrick(i);
+}
+
+/* blockdist changed: restart every brick from where it is at the new speed */
+void rebaseBricks()
+{
+  int i;
+  fallSpeed = blockdist;
+  for(i=0;i<bricks.count;i++)
+    setBrickY(i, bricks.y[i]);
+}
+
+/* Render interpolation: frames fall between ticks, so draw() shows what
+   moves at renderAlpha of the way from the state before the last tick
+   to the state after it. Running fewer ticks than frames then still looks
+   smooth, at the cost of showing the game up to one tick late. Bullets and
+   bricks keep their previous position themselves */
+// A move this long in one tick is a jump (caught in a bin) and is not blended
+#define SNAP_DISTANCE 1.0f
+
+struct TickState {
+  float binpos[3];
+  float laserpos[3];
+} previous;
+
+float renderAlpha = 1;  // fraction of a tick the clock is past the last one
+bool interpolate = true;  // --no-interpolation draws the last tick as is
+
+/* Called before every tick */
+void saveTickState()
+{
+  memcpy(bullets.previousX, bullets.x, bullets.count*sizeof(float));
+  memcpy(bullets.previousY, bullets.y, bullets.count*sizeof(float));
+  memcpy(bricks.previousY, bricks.y, bricks.count*sizeof(float));
+  memcpy(previous.binpos, binpos, sizeof(previous.binpos));
+  memcpy(previous.laserpos, laserpos, sizeof(previous.laserpos));
+}
+
+float blend(float before, float now)
+{
+  if(fabsf(now - before) > SNAP_DISTANCE)
+    return now;
+  return before + (now - before)*renderAlpha;
+}
+
+float renderBinpos(int i)
+{
+  return blend(previous.binpos[i], binpos[i]);
+}
+
+float renderLaserpos(int i)
+{
+  return blend(previous.laserpos[i], laserpos[i]);
+}
+
+/* Instance i is brick i; the buffer grows with the pool */
+void createFallingRenderer()
+{
+  int stride = sizeof(FallingBrickInstance);
+  createInstanceRenderer(fallingRenderer, unitRectangle, stride);
+  instanceAttrib(2, 2, offsetof(FallingBrickInstance, brick.x), stride);
+  instanceAttrib(3, 2, offsetof(FallingBrickInstance, brick.length), stride);
+  instanceAttrib(1, 3, offsetof(FallingBrickInstance, brick.R), stride);
+  instanceAttrib(5, 2, offsetof(FallingBrickInstance, fall), stride);
+  growFallingRenderer();
+  fallSpeed = blockdist;
+}
+
+void drawFallingBricks()
+{
+  if(bricks.count == 0)
+    return;
+  DrawCommand& c = queueDraw(fallingProgramID, fallingRenderer.VertexArrayID, GL_TRIANGLES, 0, unitRectangle->NumVertices);
+  c.instances = bricks.count;
+  c.matrix = queueMatrix(VP);
+  c.uniform = fallTicksID;
+  // the tick before the last one plus renderAlpha, as blend() does on the CPU
+  c.uniformValue = fallTicks - 1 + renderAlpha;
+}
+
+void drawBricks()
+{
+  int i,n;
+  if(gpuFalling)
+  {
+    // one call for all bricks with nothing sent per frame: no culling to do
+    drawFallingBricks();
+    return;
+  }
+  n = bricks.count;
+  BrickInstance* b = (BrickInstance*)mapInstances(brickRenderer, n);
+  if(b==NULL)
+    return;
+  BrickInstance* first = b;
+  for(i=0;i<n;i++)
+  {
+    float y = blend(bricks.previousY[i], bricks.y[i]);
+    if(inView(bricks.x[i], y, bricks.length[i], bricks.width[i]))
+      b = writeBrickInstance(b, i, y);
+  }
+  n = b - first;
+  glstats.brickBytes += n*sizeof(BrickInstance);
+  drawInstances(brickRenderer, n);
+}
+
+void drawBullets()
+{
+  int i,n;
+  n = bullets.count;
+  BulletInstance* b = (BulletInstance*)mapInstances(bulletRenderer, n);
+  if(b==NULL)
+    return;
+  BulletInstance* first = b;
+  for(i=0;i<bullets.count;i++)
+  {
+    float x = blend(bullets.previousX[i], bullets.x[i]);
+    float y = blend(bullets.previousY[i], bullets.y[i]);
+    // within 0.41 of its start whatever the angle
+    if(!inView(x-0.41, y+0.41, 0.82, 0.82))
+      continue;
+    b->x = x;
+    b->y = y;
+    b->angle = bullets.angle[i];
+    b++;
+  }
+  n = b - first;
+  DrawCommand* c = drawInstances(bulletRenderer, n);
+  if(c)
+  {
+    c->color[0] = 1;
+    c->color[1] = 1;
+    c->color[2] = 0;
+  }
 }
 
 float camera_rotation_angle = 90;
@@ -656,169 +2661,270 @@ void increaseblockdist()
 {
   blockdist=0.02+(score/25)*0.002;
 }
-void collisionwithbrick()
+/* Bullet against brick: the bullet is a box turned by its angle, the brick a
+   box along the axes, and they overlap unless one of the four edge directions
+   separates them (the separating axis test). One bullet is tested against 8
+   bricks at a time with AVX2, 4 with SSE2, or one at a time elsewhere */
+enum CollisionKernel { KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2 };
+const char* kernelNames[] = { "scalar", "SSE2", "AVX2" };
+
+struct Collisions {
+  CollisionKernel kernel;   // the fastest this CPU has
+  long pairs;               // bullet-brick pairs tested
+  double seconds;
+} collisions;
+bool collisionTest = false;  // --collision-test checks the kernels and exits
+bool poolTest = false;       // --pool-test checks the pool handles and exits
+
+/* A bullet ready for the test: its centre, its direction u and the
+   perpendicular v, its half length along u and half width along v, and
+   how far it reaches from the centre along x and y */
+struct BulletBox {
+  float cx, cy;
+  float ux, uy, vx, vy;
+  float ex, ey;
+  float aux, auy, avx, avy; // |ux|, |uy|, |vx|, |vy|
+  float rx, ry;
+};
+
+BulletBox bulletBox(int i)
 {
-  int i,p,h,r,u;
-  int j;
-  float c1,c2,c4,c3,bx,by,l,w,angle,x,y,len,wid,leng,wids;
-  for(i=bulletstart;i!=(bulletend+1)%100;i=(i+1)%100)
+  BulletBox b;
+  float angle = bullets.angle[i]*M_PI/180.0f;
+  b.ux = cos(angle);
+  b.uy = sin(angle);
+  // the mesh runs from x,y along u and width down from there
+  b.vx = b.uy;
+  b.vy = -b.ux;
+  b.ex = bullets.length[i]/2;
+  b.ey = bullets.width[i]/2;
+  b.cx = bullets.x[i] + b.ux*b.ex + b.vx*b.ey;
+  b.cy = bullets.y[i] + b.uy*b.ex + b.vy*b.ey;
+  b.aux = fabsf(b.ux);
+  b.auy = fabsf(b.uy);
+  b.avx = fabsf(b.vx);
+  b.avy = fabsf(b.vy);
+  b.rx = b.ex*b.aux + b.ey*b.avx;
+  b.ry = b.ex*b.auy + b.ey*b.avy;
+  return b;
+}
+
+/* The reference test; the SIMD kernels do the same operations in the same
+   order, so they give the same answer for every pair */
+bool overlaps(const BulletBox& b, float x, float y, float length, float width)
+{
+  float hx = length*0.5f, hy = width*0.5f;
+  float dx = (x + hx) - b.cx, dy = (y - hy) - b.cy;
+  return fabsf(dx) <= hx + b.rx
+      && fabsf(dy) <= hy + b.ry
+      && fabsf(dx*b.ux + dy*b.uy) <= (b.ex + hx*b.aux) + hy*b.auy
+      && fabsf(dx*b.vx + dy*b.vy) <= (b.ey + hx*b.avx) + hy*b.avy;
+}
+
+/* The first brick from index from on that the bullet overlaps, count if none */
+int nextHitScalar(const BulletBox& b, int from, int count)
+{
+  for(int j=from;j<count;j++)
+    if(overlaps(b, bricks.x[j], bricks.y[j], bricks.length[j], bricks.width[j]))
+      return j;
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The SIMD kernels read whole blocks of 4 or 8 from the aligned brick arrays,
+   whose capacity is a multiple of 64, and ignore the lanes outside from..count-1 */
+__attribute__((target("sse2")))
+int nextHitSSE2(const BulletBox& b, int from, int count)
+{
+  const __m128 sign = _mm_set1_ps(-0.0f), half = _mm_set1_ps(0.5f);
+  const __m128 cx = _mm_set1_ps(b.cx), cy = _mm_set1_ps(b.cy);
+  const __m128 ux = _mm_set1_ps(b.ux), uy = _mm_set1_ps(b.uy), vx = _mm_set1_ps(b.vx), vy = _mm_set1_ps(b.vy);
+  const __m128 ex = _mm_set1_ps(b.ex), ey = _mm_set1_ps(b.ey);
+  const __m128 aux = _mm_set1_ps(b.aux), auy = _mm_set1_ps(b.auy), avx = _mm_set1_ps(b.avx), avy = _mm_set1_ps(b.avy);
+  const __m128 rx = _mm_set1_ps(b.rx), ry = _mm_set1_ps(b.ry);
+  for(int j=from & ~3;j<count;j+=4)
   {
-    for(j=leftstart;j!=(leftend+1)%100;j=(j+1)%100)
-    {
-      bx=bullets[i][0];
-      by=bullets[i][1];
-      l=bullets[i][2];
-      w=bullets[i][3];
-      angle=(bullets[i][4]*M_PI)/180.0f;
-      x=leftbrick[j][1];
-      y=leftbrick[j][2];
-      len=leftbrick[j][3];
-      wid=leftbrick[j][4];
-      // c1=(2*bx+w*sin(angle)+l*cos(angle))/2;
-      // c2=(2*by-w*cos(angle)+l*sin(angle))/2;
-      c1=bx+(l*cos(angle))/2;
-      c2=by+(l*sin(angle))/2;
-      c3=x+len/2;
-      c4=y-wid/2;
-      if(fabs(c1-c3)<=(l+len)/2 && fabs(c2-c4)<=(w+wid)/2)
-      {
-        system("mpg123 -vC sounds/4.mp3 &");
-        bullets[i][0]=10;
-        bullets[i][1]=10;
-       leftbrick[j][1]=100;
-       leftbrick[j][2]=100;
-       if(leftbrick[j][0]==0)
-       score+=2;
-       else
-       score-=1;
-       increaseblockdist();
-      }
-    }
+    __m128 hx = _mm_mul_ps(_mm_load_ps(&bricks.length[j]), half);
+    __m128 hy = _mm_mul_ps(_mm_load_ps(&bricks.width[j]), half);
+    __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_load_ps(&bricks.x[j]), hx), cx);
+    __m128 dy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&bricks.y[j]), hy), cy);
+    __m128 du = _mm_add_ps(_mm_mul_ps(dx, ux), _mm_mul_ps(dy, uy));
+    __m128 dv = _mm_add_ps(_mm_mul_ps(dx, vx), _mm_mul_ps(dy, vy));
+    __m128 in = _mm_cmple_ps(_mm_andnot_ps(sign, dx), _mm_add_ps(hx, rx));
+    in = _mm_and_ps(in, _mm_cmple_ps(_mm_andnot_ps(sign, dy), _mm_add_ps(hy, ry)));
+    in = _mm_and_ps(in, _mm_cmple_ps(_mm_andnot_ps(sign, du),
+                                     _mm_add_ps(_mm_add_ps(ex, _mm_mul_ps(hx, aux)), _mm_mul_ps(hy, auy))));
+    in = _mm_and_ps(in, _mm_cmple_ps(_mm_andnot_ps(sign, dv),
+                                     _mm_add_ps(_mm_add_ps(ey, _mm_mul_ps(hx, avx)), _mm_mul_ps(hy, avy))));
+    int mask = _mm_movemask_ps(in);
+    if(j < from)
+      mask &= ~0u << (from - j);
+    if(count - j < 4)
+      mask &= (1 << (count - j)) - 1;
+    if(mask)
+      return j + __builtin_ctz(mask);
   }
-  for(i=bulletstart;i!=(bulletend+1)%100;i=(i+1)%100)
+  return count;
+}
+
+__attribute__((target("avx2")))
+int nextHitAVX2(const BulletBox& b, int from, int count)
+{
+  const __m256 sign = _mm256_set1_ps(-0.0f), half = _mm256_set1_ps(0.5f);
+  const __m256 cx = _mm256_set1_ps(b.cx), cy = _mm256_set1_ps(b.cy);
+  const __m256 ux = _mm256_set1_ps(b.ux), uy = _mm256_set1_ps(b.uy), vx = _mm256_set1_ps(b.vx), vy = _mm256_set1_ps(b.vy);
+  const __m256 ex = _mm256_set1_ps(b.ex), ey = _mm256_set1_ps(b.ey);
+  const __m256 aux = _mm256_set1_ps(b.aux), auy = _mm256_set1_ps(b.auy), avx = _mm256_set1_ps(b.avx), avy = _mm256_set1_ps(b.avy);
+  const __m256 rx = _mm256_set1_ps(b.rx), ry = _mm256_set1_ps(b.ry);
+  for(int j=from & ~7;j<count;j+=8)
   {
-    for(j=rightstart;j!=(rightend+1)%100;j=(j+1)%100)
-    {
-      bx=bullets[i][0];
-      by=bullets[i][1];
-      l=bullets[i][2];
-      w=bullets[i][3];
-      angle=bullets[i][4]*M_PI/180.0f;
-      x=rightbrick[j][1];
-      y=rightbrick[j][2];
-      len=rightbrick[j][3];
-      wid=rightbrick[j][4];
-      c1=bx+(l*cos(angle))/2;
-      c2=by+(l*sin(angle))/2;
-      // c1=(2*bx+w*sin(angle)+l*cos(angle))/2;
-      // c2=(2*by-w*cos(angle)+l*sin(angle))/2;
-      c3=x+len/2;
-      c4=y-wid/2;
-      if(fabs(c1-c3)<=(l+len)/2 && fabs(c2-c4)<=(w+wid)/2)
-      {
-        system("mpg123 -vC sounds/4.mp3 &");
-        bullets[i][0]=10;
-        bullets[i][1]=10;
-       rightbrick[j][1]=100;
-       rightbrick[j][2]=100;
-       if(rightbrick[j][0]==0)
-       score+=2;
-       else
-       score-=1;
-       increaseblockdist();
-      }
-    }
+    __m256 hx = _mm256_mul_ps(_mm256_load_ps(&bricks.length[j]), half);
+    __m256 hy = _mm256_mul_ps(_mm256_load_ps(&bricks.width[j]), half);
+    __m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_load_ps(&bricks.x[j]), hx), cx);
+    __m256 dy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(&bricks.y[j]), hy), cy);
+    __m256 du = _mm256_add_ps(_mm256_mul_ps(dx, ux), _mm256_mul_ps(dy, uy));
+    __m256 dv = _mm256_add_ps(_mm256_mul_ps(dx, vx), _mm256_mul_ps(dy, vy));
+    __m256 in = _mm256_cmp_ps(_mm256_andnot_ps(sign, dx), _mm256_add_ps(hx, rx), _CMP_LE_OQ);
+    in = _mm256_and_ps(in, _mm256_cmp_ps(_mm256_andnot_ps(sign, dy), _mm256_add_ps(hy, ry), _CMP_LE_OQ));
+    in = _mm256_and_ps(in, _mm256_cmp_ps(_mm256_andnot_ps(sign, du),
+                                         _mm256_add_ps(_mm256_add_ps(ex, _mm256_mul_ps(hx, aux)), _mm256_mul_ps(hy, auy)), _CMP_LE_OQ));
+    in = _mm256_and_ps(in, _mm256_cmp_ps(_mm256_andnot_ps(sign, dv),
+                                         _mm256_add_ps(_mm256_add_ps(ey, _mm256_mul_ps(hx, avx)), _mm256_mul_ps(hy, avy)), _CMP_LE_OQ));
+    int mask = _mm256_movemask_ps(in);
+    if(j < from)
+      mask &= ~0u << (from - j);
+    if(count - j < 8)
+      mask &= (1 << (count - j)) - 1;
+    if(mask)
+      return j + __builtin_ctz(mask);
   }
+  return count;
 }
-int checkpoint(float x,float y,float a,float b,float c)
+#endif
+
+int nextHit(CollisionKernel kernel, const BulletBox& b, int from, int count)
 {
-  float ans;
-  ans=a*x+b*y+c;
-  if(ans>=0)
-  return 1;
-  else
-  return -1;
+#if defined(__x86_64__) || defined(__i386__)
+  if(kernel == KERNEL_AVX2)
+    return nextHitAVX2(b, from, count);
+  if(kernel == KERNEL_SSE2)
+    return nextHitSSE2(b, from, count);
+#endif
+  return nextHitScalar(b, from, count);
 }
-int checkinside(float x,float y,float a,float b)
+
+void chooseCollisionKernel()
 {
-  if(y>=a && y<=b)
-  return 1;
-  else
-  return -1;
+  collisions.kernel = KERNEL_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("avx2"))
+    collisions.kernel = KERNEL_AVX2;
+  else if(__builtin_cpu_supports("sse2"))
+    collisions.kernel = KERNEL_SSE2;
+#endif
 }
-void collisionwithleftbrick(float x,float y,float dy,float uy,int number)
+
+void collisionwithbrick()
 {
-  float a,b,c,bx,by,l,w,angle,a1,b1,c1,intersection_x,intersection_y,slope,final_angle;
-  int p,h,u,r,i;
-  a=1;
-  b=0;
-  c=-1*x;
-  for(i=bulletstart;i!=(bulletend+1)%100;i=(i+1)%100)
+  int i,hit;
+  double start = wallClock();
+  for(i=0;i<bullets.count;)
   {
-    bx=bullets[i][0];
-    by=bullets[i][1];
-    l=bullets[i][2];
-    w=bullets[i][3];
-    angle=(bullets[i][4]*M_PI)/180.0f;
-    p=checkpoint(bx,by,a,b,c);
-    h=checkpoint(bx+l*cos(angle),by+l*sin(angle),a,b,c);
-    u=checkpoint(bx+w*sin(angle),by-w*cos(angle),a,b,c);
-    r=checkpoint(bx+w*sin(angle)+l*cos(angle),by-w*cos(angle)+l*sin(angle),a,b,c);
-    if((p==1 && h==1 && u==1 && r==1) || (p==-1 && h==-1 && u==-1 && r==-1))
+    hit=nextHit(collisions.kernel, bulletBox(i), 0, bricks.count);
+    collisions.pairs += min(hit+1, bricks.count);
+    if(hit==bricks.count)
     {
-      //cout<<"no\n";
+      i++;
+      continue;
     }
+    playSound("mpg123 -vC sounds/4.mp3 &");
+    if(bricks.color[hit]==0)
+    score+=2;
     else
-    {
-      angle=angle*180.0f/M_PI;
-      if(angle!=90)
-        {
-        a1=-1.0*tan(angle*M_PI/180);
-        b1=1;
-        c1=tan(angle*M_PI/180)*bx-by;
-        }
-        else
-        {
-          a1=1;
-          b1=0;
-          c1=-1*bx;
-        }
-        intersection_x=(b*c1-b1*c)/(b1*a-b*a1);
-        intersection_y=(a*c1-a1*c)/(b*a1-b1*a);
-//        cout<<intersection_x<<" "<<intersection_y<<" "<<dy<<" "<<uy<<endl;
-        if(intersection_y>=dy && intersection_y<=uy)
-        {
-        leftbrick[number][1]=10;
-        leftbrick[number][2]=10;
-        bullets[i][0]=10;
-        bullets[i][1]=10;
-         }
-       if(angle!=90)
-       {
-       a1=-1.0*tan(angle*M_PI/180);
-       b1=1;
-       c1=tan(angle*M_PI/180)*(bx+w*sin(angle))-(by-w*cos(angle));
-       }
-       else
-       {
-         a1=1;
-         b1=0;
-         c1=-1*(bx+w*sin(angle));
-       }
-       intersection_x=(b*c1-b1*c)/(b1*a-b*a1);
-       intersection_y=(a*c1-a1*c)/(b*a1-b1*a);
-       //cout<<intersection_x<<" "<<intersection_y<<" "<<dy<<" "<<uy<<endl;
-       if(intersection_y>=dy && intersection_y<=uy)
-       {
-       leftbrick[number][1]=10;
-       leftbrick[number][2]=10;
-       //collidedmirror[i]=number;
-       bullets[i][0]=100;
-       bullets[i][1]=100;
-       //bullets[i][4]=final_angle;
-      }
+    score-=1;
+    removeBrick(hit);
+    increaseblockdist();
+    // both are gone; the bullet moved to i is checked next
+    removeBullet(i);
+  }
+  collisions.seconds += wallClock() - start;
+}
+
+/* --collision-test: every SIMD kernel against the scalar one on random
+   bullets and bricks, with the pairs per second of each. True if all agree */
+bool testCollisionKernels()
+{
+  const int nBullets = 1000, nBricks = 5000, rounds = 4;
+  int i,j,k;
+  // straight into the arrays the kernels read: this runs before there is a
+  // GL context, so nothing may reach the --gpu-falling renderer
+  srand(1);
+  while(bricks.capacity < nBricks)
+    growBricks();
+  bricks.count = nBricks;
+  for(i=0;i<nBricks;i++)
+  {
+    bricks.x[i] = -4 + 8.0f*rand()/RAND_MAX;
+    bricks.y[i] = -4 + 8.0f*rand()/RAND_MAX;
+    bricks.length[i] = 0.05f + 0.5f*rand()/RAND_MAX;
+    bricks.width[i] = 0.05f + 0.8f*rand()/RAND_MAX;
+  }
+  while(bullets.capacity < nBullets)
+    growBullets();
+  bullets.count = nBullets;
+  vector<BulletBox> boxes;
+  for(i=0;i<nBullets;i++)
+  {
+    bullets.angle[i] = 360.0f*rand()/RAND_MAX;
+    bullets.x[i] = -4 + 8.0f*rand()/RAND_MAX;
+    bullets.y[i] = -4 + 8.0f*rand()/RAND_MAX;
+    bullets.length[i] = 0.4;
+    bullets.width[i] = 0.05;
+    boxes.push_back(bulletBox(i));
+  }
+  // every overlapping pair, in order, as the scalar kernel finds them
+  vector<int> reference;
+  bool ok = true;
+  printf("Collision test: %d bullets against %d bricks\n", nBullets, nBricks);
+  for(k=KERNEL_SCALAR;k<=collisions.kernel;k++)
+  {
+    vector<int> hits;
+    double start = wallClock();
+    for(int r=0;r<rounds;r++)
+    {
+      hits.clear();
+      for(i=0;i<nBullets;i++)
+      {
+        for(j=nextHit((CollisionKernel)k, boxes[i], 0, nBricks);j<nBricks;j=nextHit((CollisionKernel)k, boxes[i], j+1, nBricks))
+          hits.push_back(i*nBricks + j);
       }
     }
+    double seconds = wallClock() - start;
+    if(k == KERNEL_SCALAR)
+      reference = hits;
+    bool same = hits == reference;
+    ok = ok && same;
+    printf("  %-6s %8.1f million pairs per second, %zu overlapping%s\n", kernelNames[k],
+           (double)rounds*nBullets*nBricks / seconds / 1e6, hits.size(),
+           k == KERNEL_SCALAR ? "" : same ? ", same as scalar" : ", DIFFERENT from scalar");
+  }
+  return ok;
+}
+int checkpoint(float x,float y,float a,float b,float c)
+{
+  float ans;
+  ans=a*x+b*y+c;
+  if(ans>=0)
+  return 1;
+  else
+  return -1;
+}
+int checkinside(float x,float y,float a,float b)
+{
+  if(y>=a && y<=b)
+  return 1;
+  else
+  return -1;
 }
 void collisionwithmirror(float mirror_angle,float x,float y,float dy,float uy,int number)
 {
@@ -837,13 +2943,13 @@ void collisionwithmirror(float mirror_angle,float x,float y,float dy,float uy,in
   b=0;
   c=-1*x;
  }
-  for(i=bulletstart;i!=(bulletend+1)%100;i=(i+1)%100)
+  for(i=0;i<bullets.count;i++)
   {
-    bx=bullets[i][0];
-    by=bullets[i][1];
-    l=bullets[i][2];
-    w=bullets[i][3];
-    angle=(bullets[i][4]*M_PI)/180.0f;
+    bx=bullets.x[i];
+    by=bullets.y[i];
+    l=bullets.length[i];
+    w=bullets.width[i];
+    angle=(bullets.angle[i]*M_PI)/180.0f;
     p=checkpoint(bx,by,a,b,c);
     h=checkpoint(bx+l*cos(angle),by+l*sin(angle),a,b,c);
     u=checkpoint(bx+w*sin(angle),by-w*cos(angle),a,b,c);
@@ -875,15 +2981,15 @@ void collisionwithmirror(float mirror_angle,float x,float y,float dy,float uy,in
         }
         intersection_x=(b*c1-b1*c)/(b1*a-b*a1);
         intersection_y=(a*c1-a1*c)/(b*a1-b1*a);
-        final_angle=2*mirror_angle-bullets[i][4];
+        final_angle=2*mirror_angle-bullets.angle[i];
         //cout<<intersection_x<<" "<<intersection_y<<" "<<final_angle<<" "<<fl<<endl;
-        if(intersection_y>=dy && intersection_y<=uy && collidedmirror[i]!=number)
+        if(intersection_y>=dy && intersection_y<=uy && bullets.mirror[i]!=number)
         {
-        collidedmirror[i]=number;
-        bullets[i][0]=intersection_x;
-        bullets[i][1]=intersection_y;
-        bullets[i][4]=final_angle;
-        system("mpg123 -vC sounds/2.mp3 &");
+        bullets.mirror[i]=number;
+        bullets.x[i]=intersection_x;
+        bullets.y[i]=intersection_y;
+        aimBullet(i,final_angle);
+        playSound("mpg123 -vC sounds/2.mp3 &");
        }
       }
     }
@@ -907,28 +3013,879 @@ int checkingreenbin(float x,float y)
   return -1;
 }
 
-void draw (double xpos,double ypos)
+/* Position and angle of mirror[1..4] (the bars built in initGL) */
+constexpr float mirrors[4][3] = {
+  {-0.75,0,60},{2.75,-1.5,60},{-0.25,3,120},{3,2,120}
+};
+
+/* Bins, bin rims and mirrors: everything that only moves when a bin does */
+void drawStaticLayer()
 {
-  if(pause==1)
-  return;
+  setDrawLayer(LAYER_STATIC);
+  setPose(binNode[1], -1+renderBinpos(1)-0.75, -4, 0);
+  setPose(binNode[2], 1.5+renderBinpos(2), -4, 0);
+  // The bins stay out of the sprite batch: the rims drawn after them must stay on top
+  if(redbin==1)
+  drawMesh(unitRectangle, binBody[1], 1, 0, 0);
+  else
+  drawMesh(unitRectangle, binBody[1], 1, 0.3, 0.3);
+  if(greenbin==1)
+  drawMesh(unitRectangle, binBody[2], 0, 0.6, 0);
+  else
+  drawMesh(unitRectangle, binBody[2], 0.1, 1, 0.1);
+
+  setDrawLayer(LAYER_RIMS);
+  drawCircle(binRim[1], 1, 0.4, 0.4);
+  drawCircle(binRim[2], 0.3, 1, 0.3);
+
+  // mirrors never overlap the bins or rims
+  setDrawLayer(LAYER_STATIC);
+  for(int i=0;i<4;i++)
+  {
+    // a mirror stays within 0.76 of its position at any angle
+    if(!inView(mirrors[i][0]-0.76, mirrors[i][1]+0.76, 1.52, 1.52))
+      continue;
+    // draw3DObject queues the VAO given to it with this MVP
+    draw3DObject(mirror[i+1], transformMVP(mirrorNode[i]));
+  }
+}
+
+/* Build the cannon, bin and mirror nodes. Only the poses of the cannon and
+   the bins change afterwards */
+void createTransforms()
+{
+  initTransform(cannonBase, NULL);
+  initTransform(cannonBarrel, NULL);
+  initTransform(cannonTip, &cannonBarrel, glm::translate(glm::vec3(0.5,0,0)) * glm::scale(glm::vec3(0.125,0.125,1)));
+  for(int i=1;i<=2;i++)
+  {
+    initTransform(binNode[i], NULL);
+    // the body is a unit rectangle stretched to createRectangle(0,1.5,1,1.5)
+    initTransform(binBody[i], &binNode[i], glm::translate(glm::vec3(0,1.5,0)) * glm::scale(glm::vec3(1,1.5,1)));
+    // the rim is a disc of radius 0.5 over the mouth of the bin, tilted back
+    initTransform(binRim[i], &binNode[i], glm::translate(glm::vec3(0.5,1.5,0))
+                  * glm::rotate((float)(-60*M_PI/180.0f), glm::vec3(1,0,0)) * glm::scale(glm::vec3(0.5,0.5,1)));
+  }
+  for(int i=0;i<4;i++)
+  {
+    initTransform(mirrorNode[i], NULL);
+    setPose(mirrorNode[i], mirrors[i][0], mirrors[i][1], mirrors[i][2]);
+  }
+}
+
+/* Draw the static layer: from the cached textures when nothing it depends on
+   changed, otherwise render it into them first */
+void compositeStaticLayer()
+{
+  StaticLayer& l = staticLayer;
+  if(!l.usable)
+  {
+    drawStaticLayer();
+    return;
+  }
+  if(!l.valid || l.zoom != zoom || l.pan != pan || l.pany != pany || l.redbinpos != renderBinpos(1)
+     || l.greenbinpos != renderBinpos(2) || l.redbin != redbin || l.greenbin != greenbin)
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, l.Framebuffer);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    drawList = &layerList;
+    drawStaticLayer();
+    submitDrawList(layerList);
+    drawList = &frameList;
+    glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+    l.valid = true;
+    l.zoom = zoom;
+    l.pan = pan;
+    l.pany = pany;
+    l.redbinpos = renderBinpos(1);
+    l.greenbinpos = renderBinpos(2);
+    l.redbin = redbin;
+    l.greenbin = greenbin;
+    l.renders++;
+  }
+
+  // The screen was just cleared, so every pixel passes the depth test.
+  // Nothing else uses textures, so they can be bound before the draw is issued
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, l.ColorTexture);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, l.DepthTexture);
+  setDrawLayer(LAYER_STATIC);
+  queueDraw(l.ProgramID, l.VertexArrayID, GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* Strokes of the "SCORE" label: x, y, length, width (the 17th is the R's leg,
+   drawn rotated about (3.22,3.642)) */
+constexpr float scoreletters[21][4] = {
+  {2.5,3.872,0.2,0.02},{2.5,3.871,0.01,0.2},{2.5,3.671,0.2,0.015},{2.7,3.656,0.01,0.2},{2.5,3.456,0.2,0.015},
+  {2.725,3.872,0.2,0.02},{2.725,3.871,0.02,0.45},{2.725,3.436,0.2,0.015},
+  {2.967,3.872,0.2,0.02},{2.967,3.871,0.02,0.45},{2.967,3.436,0.2,0.015},{3.167,3.872,0.015,0.45},
+  {3.22,3.872,0.015,0.45},{3.235,3.872,0.2,0.02},{3.435,3.871,0.015,0.23},{3.22,3.642,0.23,0.015},{0,0,0.32,0.0152},
+  {3.5,3.872,0.015,0.46},{3.515,3.872,0.2,0.015},{3.515,3.642,0.2,0.015},{3.515,3.414,0.2,0.015}
+};
+
+/* Seven-segment glyphs for the HUD. Segment boxes use the createRectangle
+   layout, relative to the top left of a glyph (0.25 wide, 0.43 high at size 1) */
+constexpr float glyphSegments[7][4] = {
+  {0,0,0.01,0.22},        // upper left
+  {0,-0.19,0.01,0.22},    // lower left
+  {0,-0.42,0.22,0.01},    // bottom
+  {0.24,-0.19,0.01,0.22}, // lower right
+  {0.24,0,0.01,0.22},     // upper right
+  {0,-0.01,0.22,0.01},    // top
+  {0,-0.25,0.22,0.01}     // middle
+};
+
+/* Bit s is set when glyphSegments[s] is lit */
+constexpr unsigned char digitMasks[10] = {
+  0x3F, 0x18, 0x76, 0x7C, 0x59, 0x6D, 0x6F, 0x38, 0x7F, 0x79
+};
+
+/* Digits and the few letters the HUD needs; anything else is blank */
+constexpr unsigned char glyphMask(char c)
+{
+  return c>='0' && c<='9' ? digitMasks[c-'0'] :
+         c=='L' ? 0x07 : c=='E' ? 0x67 : c=='V' ? 0x1F : // V drawn as U
+         c=='F' ? 0x63 : c=='P' ? 0x73 : c=='S' ? 0x6D : 0;
+}
+
+#define HUD_CAPACITY 4096
+
+/* Lives, score, level and FPS, kept in their own vertex buffer (BatchVertex
+   layout, world space) that is rebuilt only when a shown value changes */
+struct HUD {
+  GLuint VertexArrayID;
+  GLuint VertexBuffer;
+  int count;          // vertices in the buffer
+  bool valid;
+  int score, leftlives, rightlives, level, fps; // values in the buffer
+  int frames;         // since fpsTime
+  double fpsTime;
+  long rebuilds;
+  vector<BatchVertex> vertices;
+} hud;
+
+void createHUD()
+{
+  glGenVertexArrays(1, &hud.VertexArrayID);
+  glGenBuffers(1, &hud.VertexBuffer);
+  glstats.objectsCreated += 2;
+  glstats.bufferUploads += 1;
+
+  setVertexArray(hud.VertexArrayID);
+  setArrayBuffer(hud.VertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, HUD_CAPACITY*sizeof(BatchVertex), NULL, GL_DYNAMIC_DRAW);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (void*)offsetof(BatchVertex, x));
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (void*)offsetof(BatchVertex, R));
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  hud.vertices.reserve(HUD_CAPACITY);
+  hud.fpsTime = gameClock();
+}
+
+void hudVertex(const glm::mat4& model, float x, float y, float R, float G, float B)
+{
+  glm::vec4 p = model * glm::vec4(x, y, 0, 1);
+  BatchVertex v = {p.x, p.y, R, G, B};
+  hud.vertices.push_back(v);
+}
+
+void hudRectangle(float x,float y,float length,float width,float R,float G,float B,const glm::mat4& model)
+{
+  hudVertex(model, x, y-width, R, G, B);
+  hudVertex(model, x, y, R, G, B);
+  hudVertex(model, x+length, y, R, G, B);
+
+  hudVertex(model, x+length, y, R, G, B);
+  hudVertex(model, x+length, y-width, R, G, B);
+  hudVertex(model, x, y-width, R, G, B);
+}
+
+/* Text in seven-segment glyphs, top left at (x,y). size scales the glyph but
+   not the stroke width */
+void hudText(const char* text,float x,float y,float size,float R,float G,float B)
+{
+  glm::mat4 none(1.0f);
+  for(; *text; text++, x+=0.4f*size)
+  {
+    unsigned char mask = glyphMask(*text);
+    for(int s=0;s<7;s++)
+    {
+      if(!(mask & (1<<s)))
+        continue;
+      const float* g = glyphSegments[s];
+      bool vertical = g[2] < g[3];
+      hudRectangle(x+g[0]*size, y+g[1]*size, vertical ? g[2] : g[2]*size,
+                   vertical ? g[3]*size : g[3], R, G, B, none);
+    }
+  }
+}
+
+void buildHUD()
+{
+  int i;
+  char text[32];
+  glm::mat4 none(1.0f);
+  hud.vertices.clear();
+
+  for(i=0;i<leftlives;i++)
+    hudRectangle(-3.7,-2.6-i*0.3,0.2,0.2,1,0.2,0.6,none);
+  for(i=0;i<rightlives;i++)
+    hudRectangle(3.3,-2.464-i*0.3,0.2,0.2,1,0.2,0.6,none);
+
+  for(i=0;i<21;i++)
+  {
+    glm::mat4 model = none;
+    if(i==16)
+      model = glm::translate(glm::vec3(3.22,3.642,0)) * glm::rotate((float)(315*M_PI/180.0f), glm::vec3(0,0,1));
+    hudRectangle(scoreletters[i][0],scoreletters[i][1],scoreletters[i][2],scoreletters[i][3],0,0,0,model);
+  }
+  snprintf(text, sizeof(text), "%d", hud.score);
+  hudText(text, 2.69, 3.12, 1, 0, 0, 0);
+
+  snprintf(text, sizeof(text), "LEV %d", hud.level);
+  hudText(text, 2.95, 1.8, 0.4, 0, 0, 0);
+  snprintf(text, sizeof(text), "FPS %d", hud.fps);
+  hudText(text, 2.95, 1.5, 0.4, 0, 0, 0);
+
+  hud.count = min((int)hud.vertices.size(), HUD_CAPACITY);
+  setArrayBuffer(hud.VertexBuffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, hud.count*sizeof(BatchVertex), &hud.vertices[0]);
+  hud.valid = true;
+  hud.rebuilds++;
+}
+
+void drawHUD()
+{
+  // frames per second, measured over about a second
+  hud.frames++;
+  double now = gameClock();
+  int fps = hud.fps;
+  if(now - hud.fpsTime >= 1)
+  {
+    fps = (int)(hud.frames / (now - hud.fpsTime) + 0.5);
+    hud.frames = 0;
+    hud.fpsTime = now;
+  }
+
+  int level = score/25 + 1; // blockdist goes up every 25 points, see increaseblockdist
+  if(!hud.valid || hud.score != score || hud.leftlives != leftlives || hud.rightlives != rightlives
+     || hud.level != level || hud.fps != fps)
+  {
+    hud.score = score;
+    hud.leftlives = leftlives;
+    hud.rightlives = rightlives;
+    hud.level = level;
+    hud.fps = fps;
+    buildHUD();
+  }
+
+  setDrawLayer(LAYER_HUD);
+  DrawCommand& c = queueDraw(programID, hud.VertexArrayID, GL_TRIANGLES, 0, hud.count);
+  c.matrix = queueMatrix(VP);
+}
+
+/* --software: the frame's draw list is rasterized on the CPU instead of by
+   GL. The sorted commands become window-space triangles, which are binned
+   into tiles; the tiles are then cleared and shaded in parallel, one thread
+   per tile at a time, so no two threads touch the same pixels. GL is only
+   used to upload the result and blit it to the screen (or to the headless
+   framebuffer). Everything the game draws is a flat coloured triangle or a
+   Circle_GL circle, which is all this handles: fill modes are ignored and
+   only GL_TRIANGLES and GL_TRIANGLE_STRIP are assembled */
+#define SOFTWARE_TILE 64
+
+struct SoftwareVertex {
+  float x, y, z;   // window coordinates, depth in 0..1
+  float R, G, B;
+};
+
+/* What Circle_GL.frag needs: local = toLocal * (window - origin) */
+struct SoftwareCircle {
+  float originX, originY;
+  float toLocal[4]; // rows of the inverse of the local to window mapping
+  bool semicircle;
+};
+
+struct SoftwareTriangle {
+  // edge functions A*(x-X) + B*(y-Y) from a vertex (X,Y) of the edge, positive
+  // inside; the differences are exact, so pixels on an axis-aligned edge are found
+  float edgeA[3], edgeB[3], edgeX[3], edgeY[3];
+  bool topLeft[3];          // pixels centred exactly on a top or left edge are inside
+  float dzdx, dzdy, z0;     // depth plane
+  int minX, minY, maxX, maxY;
+  uint32_t color;           // RGBA8 of a flat triangle
+  float R, G, B;
+  int circle;               // index into circles, -1 for a flat triangle
+};
+
+struct SoftwareRenderer {
+  int width, height;
+  int tilesX, tilesY;
+  vector<uint32_t> color;   // RGBA8, bottom row first like GL
+  vector<float> depth;
+  vector<SoftwareVertex> vertices;  // of the command being set up
+  vector<SoftwareTriangle> triangles;
+  vector<SoftwareCircle> circles;
+  vector< vector<int> > bins;       // triangles touching each tile, in draw order
+  bool avx2;
+  // workers
+  int threads;
+  vector<thread> workers;
+  mutex lock;
+  condition_variable wake, done;
+  long generation;
+  int busy;
+  bool stopping;            // set by stopSoftwareRenderer: the workers return
+  atomic<int> nextTile;
+  // blit
+  GLuint Texture;
+  GLuint Framebuffer;
+  // benchmark
+  double seconds;
+  long frames;
+  long triangleCount;
+} software;
+
+uint32_t packRGBA(float R, float G, float B)
+{
+  return packColor(R) | packColor(G) << 8 | packColor(B) << 16 | 0xFF000000u;
+}
+
+/* Circle_GL.frag for one pixel: antialiased edge blended over what is there */
+void shadeCircle(const SoftwareTriangle& t, int index, float px, float py, float z)
+{
+  const SoftwareCircle& c = software.circles[t.circle];
+  float dx = px - c.originX, dy = py - c.originY;
+  float lx = c.toLocal[0]*dx + c.toLocal[1]*dy;
+  float ly = c.toLocal[2]*dx + c.toLocal[3]*dy;
+  float length = sqrtf(lx*lx + ly*ly);
+  float d = length - 1;
+  // gradient of d across the screen, for fwidth
+  float gx = 0, gy = 0;
+  if(length > 0)
+  {
+    gx = (lx*c.toLocal[0] + ly*c.toLocal[2]) / length;
+    gy = (lx*c.toLocal[1] + ly*c.toLocal[3]) / length;
+  }
+  if(c.semicircle && -ly > d)
+  {
+    d = -ly;
+    gx = -c.toLocal[2];
+    gy = -c.toLocal[3];
+  }
+  float w = fabsf(gx) + fabsf(gy);
+  float alpha = glm::clamp(0.5f - d/w, 0.0f, 1.0f);
+  if(!(alpha > 0))
+    return;
+  software.depth[index] = z;
+  uint32_t dst = software.color[index];
+  float R = t.R*alpha + (dst & 0xFF)/255.0f*(1-alpha);
+  float G = t.G*alpha + (dst >> 8 & 0xFF)/255.0f*(1-alpha);
+  float B = t.B*alpha + (dst >> 16 & 0xFF)/255.0f*(1-alpha);
+  software.color[index] = packRGBA(R, G, B);
+}
+
+/* One pixel of a triangle, depth test included */
+inline void shadePixel(const SoftwareTriangle& t, int x, int y)
+{
+  float px = x + 0.5f, py = y + 0.5f;
+  for(int e=0;e<3;e++)
+  {
+    float E = t.edgeA[e]*(px - t.edgeX[e]) + t.edgeB[e]*(py - t.edgeY[e]);
+    if(!(E > 0 || (E == 0 && t.topLeft[e])))
+      return;
+  }
+  int index = y*software.width + x;
+  float z = t.z0 + t.dzdx*px + t.dzdy*py;
+  if(!(z <= software.depth[index]))
+    return;
+  if(t.circle >= 0)
+    shadeCircle(t, index, px, py, z);
+  else
+  {
+    software.depth[index] = z;
+    software.color[index] = t.color;
+  }
+}
+
+void rasterizeScalar(const SoftwareTriangle& t, int x0, int y0, int x1, int y1)
+{
+  for(int y=y0;y<=y1;y++)
+    for(int x=x0;x<=x1;x++)
+      shadePixel(t, x, y);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The same, testing the edges and depth of 8 pixels of a row at once */
+__attribute__((target("avx2")))
+void rasterizeAVX2(const SoftwareTriangle& t, int x0, int y0, int x1, int y1)
+{
+  const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 A[3], X[3], topLeft[3];
+  for(int e=0;e<3;e++)
+  {
+    A[e] = _mm256_set1_ps(t.edgeA[e]);
+    X[e] = _mm256_set1_ps(t.edgeX[e]);
+    topLeft[e] = _mm256_castsi256_ps(_mm256_set1_epi32(t.topLeft[e] ? -1 : 0));
+  }
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 dzdx = _mm256_set1_ps(t.dzdx);
+  const __m256i color = _mm256_set1_epi32(t.color);
+  for(int y=y0;y<=y1;y++)
+  {
+    float py = y + 0.5f;
+    float rowZ = t.z0 + t.dzdy*py;
+    for(int x=x0;x<=x1;x+=8)
+    {
+      __m256 px = _mm256_add_ps(_mm256_set1_ps(x + 0.5f), lane);
+      // lanes past the end of the span are never inside
+      __m256 inside = _mm256_cmp_ps(lane, _mm256_set1_ps((float)(x1 - x)), _CMP_LE_OQ);
+      for(int e=0;e<3;e++)
+      {
+        __m256 E = _mm256_add_ps(_mm256_mul_ps(A[e], _mm256_sub_ps(px, X[e])), _mm256_set1_ps(t.edgeB[e]*(py - t.edgeY[e])));
+        __m256 in = _mm256_blendv_ps(_mm256_cmp_ps(E, zero, _CMP_GT_OQ), _mm256_cmp_ps(E, zero, _CMP_GE_OQ), topLeft[e]);
+        inside = _mm256_and_ps(inside, in);
+      }
+      if(_mm256_testz_ps(inside, inside))
+        continue;
+      int index = y*software.width + x;
+      __m256 z = _mm256_add_ps(_mm256_set1_ps(rowZ), _mm256_mul_ps(dzdx, px));
+      if(t.circle >= 0)
+      {
+        // few pixels are circles: the shading itself stays scalar
+        int mask = _mm256_movemask_ps(inside);
+        float zs[8];
+        _mm256_storeu_ps(zs, z);
+        for(int i=0;i<8;i++)
+          if(mask >> i & 1 && zs[i] <= software.depth[index+i])
+            shadeCircle(t, index+i, x + i + 0.5f, py, zs[i]);
+        continue;
+      }
+      // the mask keeps the loads and stores inside the span
+      __m256i store = _mm256_castps_si256(inside);
+      __m256 depth = _mm256_maskload_ps(&software.depth[index], store);
+      store = _mm256_castps_si256(_mm256_and_ps(inside, _mm256_cmp_ps(z, depth, _CMP_LE_OQ)));
+      _mm256_maskstore_ps(&software.depth[index], store, z);
+      _mm256_maskstore_epi32((int*)&software.color[index], store, color);
+    }
+  }
+}
+#endif
+
+/* Clear a tile and draw every triangle binned to it */
+void rasterizeTile(int tile)
+{
+  int tx = tile % software.tilesX, ty = tile / software.tilesX;
+  int x0 = tx*SOFTWARE_TILE, y0 = ty*SOFTWARE_TILE;
+  int x1 = min(x0 + SOFTWARE_TILE, software.width) - 1;
+  int y1 = min(y0 + SOFTWARE_TILE, software.height) - 1;
+  for(int y=y0;y<=y1;y++)
+  {
+    // glClearColor white, glClearDepth 1
+    fill(&software.color[y*software.width + x0], &software.color[y*software.width + x1] + 1, 0x00FFFFFFu);
+    fill(&software.depth[y*software.width + x0], &software.depth[y*software.width + x1] + 1, 1.0f);
+  }
+  const vector<int>& bin = software.bins[tile];
+  for(size_t i=0;i<bin.size();i++)
+  {
+    const SoftwareTriangle& t = software.triangles[bin[i]];
+    int ax = max(x0, t.minX), ay = max(y0, t.minY);
+    int bx = min(x1, t.maxX), by = min(y1, t.maxY);
+#if defined(__x86_64__) || defined(__i386__)
+    if(software.avx2)
+    {
+      rasterizeAVX2(t, ax, ay, bx, by);
+      continue;
+    }
+#endif
+    rasterizeScalar(t, ax, ay, bx, by);
+  }
+}
+
+/* Take tiles until there are none left */
+void rasterizeTiles()
+{
+  int tiles = software.tilesX*software.tilesY;
+  for(int tile = software.nextTile++; tile < tiles; tile = software.nextTile++)
+    rasterizeTile(tile);
+}
+
+void softwareWorker()
+{
+  long generation = 0;
+  for(;;)
+  {
+    {
+      unique_lock<mutex> lock(software.lock);
+      while(software.generation == generation && !software.stopping)
+        software.wake.wait(lock);
+      if(software.stopping)
+        return;
+      generation = software.generation;
+    }
+    rasterizeTiles();
+    unique_lock<mutex> lock(software.lock);
+    if(--software.busy == 0)
+      software.done.notify_one();
+  }
+}
+
+/* Set up a triangle from window-space vertices and bin it */
+void softwareTriangle(const SoftwareVertex& a, const SoftwareVertex& b, const SoftwareVertex& c, int circle)
+{
+  float area = (b.x-a.x)*(c.y-a.y) - (c.x-a.x)*(b.y-a.y);
+  if(area == 0)
+    return;
+  // counter-clockwise, so the inside is left of every edge
+  const SoftwareVertex* v[3] = {&a, area > 0 ? &b : &c, area > 0 ? &c : &b};
+  area = fabsf(area);
+
+  SoftwareTriangle t;
+  t.minX = max(0, (int)floorf(min(a.x, min(b.x, c.x))));
+  t.minY = max(0, (int)floorf(min(a.y, min(b.y, c.y))));
+  t.maxX = min(software.width-1, (int)ceilf(max(a.x, max(b.x, c.x))));
+  t.maxY = min(software.height-1, (int)ceilf(max(a.y, max(b.y, c.y))));
+  if(t.minX > t.maxX || t.minY > t.maxY)
+    return;
+  for(int e=0;e<3;e++)
+  {
+    const SoftwareVertex& p = *v[e];
+    const SoftwareVertex& q = *v[(e+1)%3];
+    t.edgeA[e] = p.y - q.y;
+    t.edgeB[e] = q.x - p.x;
+    t.edgeX[e] = p.x;
+    t.edgeY[e] = p.y;
+    // y goes up: a top edge runs right to left, a left edge runs down
+    t.topLeft[e] = q.y < p.y || (q.y == p.y && q.x > p.x);
+  }
+  const SoftwareVertex& p = *v[0];
+  float dz1 = v[1]->z - p.z, dz2 = v[2]->z - p.z;
+  float dx1 = v[1]->x - p.x, dy1 = v[1]->y - p.y;
+  float dx2 = v[2]->x - p.x, dy2 = v[2]->y - p.y;
+  t.dzdx = (dz1*dy2 - dz2*dy1) / area;
+  t.dzdy = (dz2*dx1 - dz1*dx2) / area;
+  t.z0 = p.z - t.dzdx*p.x - t.dzdy*p.y;
+  // flat shaded from the first vertex, like every mesh the game has
+  t.R = a.R;
+  t.G = a.G;
+  t.B = a.B;
+  t.color = packRGBA(a.R, a.G, a.B);
+  t.circle = circle;
+
+  int index = software.triangles.size();
+  software.triangles.push_back(t);
+  for(int ty=t.minY/SOFTWARE_TILE; ty<=t.maxY/SOFTWARE_TILE; ty++)
+    for(int tx=t.minX/SOFTWARE_TILE; tx<=t.maxX/SOFTWARE_TILE; tx++)
+      software.bins[ty*software.tilesX + tx].push_back(index);
+}
+
+/* Model space point to a window-space vertex */
+void softwareVertex(const glm::mat4& mvp, float x, float y, float R, float G, float B)
+{
+  glm::vec4 p = mvp * glm::vec4(x, y, 0, 1);
+  SoftwareVertex v;
+  // snapped to 1/256 pixel like the GL rasterizers
+  v.x = roundf((p.x/p.w*0.5f + 0.5f)*software.width*256) / 256;
+  v.y = roundf((p.y/p.w*0.5f + 0.5f)*software.height*256) / 256;
+  v.z = p.z/p.w*0.5f + 0.5f;
+  v.R = R;
+  v.G = G;
+  v.B = B;
+  software.vertices.push_back(v);
+}
+
+void softwareVertices(const glm::mat4& mvp, const BatchVertex* v, int count)
+{
+  for(int i=0;i<count;i++)
+    softwareVertex(mvp, v[i].x, v[i].y, v[i].R, v[i].G, v[i].B);
+}
+
+/* A mesh placed by scale, rotation (degrees) and offset, like Sample_GL.vert */
+void softwareInstance(const glm::mat4& mvp, const VAO* mesh, float x, float y, float sx, float sy, float angle,
+                      float R, float G, float B)
+{
+  float c = cosf(angle*M_PI/180.0f), s = sinf(angle*M_PI/180.0f);
+  for(int i=0;i<mesh->NumVertices;i++)
+  {
+    float px = mesh->positions[2*i]*sx, py = mesh->positions[2*i+1]*sy;
+    softwareVertex(mvp, c*px - s*py + x, s*px + c*py + y, R, G, B);
+  }
+}
+
+/* Turn the vertices of one command into triangles */
+void softwareAssemble(GLenum primitive, int circle)
+{
+  const vector<SoftwareVertex>& v = software.vertices;
+  int n = v.size();
+  if(primitive == GL_TRIANGLES)
+    for(int i=0;i+2<n;i+=3)
+      softwareTriangle(v[i], v[i+1], v[i+2], circle);
+  else if(primitive == GL_TRIANGLE_STRIP)
+    for(int i=0;i+2<n;i++)
+      softwareTriangle(v[i], v[i+1], v[i+2], circle);
+}
+
+/* Find the vertices of a command on the CPU side and set up its triangles */
+void softwareCommand(const DrawCommand& c, const glm::mat4& mvp)
+{
+  software.vertices.clear();
+  if(c.vertexArray == batcher.VertexArrayID)
+    softwareVertices(mvp, batcher.ring + c.first, c.count);
+  else if(c.vertexArray == hud.VertexArrayID)
+    softwareVertices(mvp, &hud.vertices[c.first], c.count);
+  else if(c.vertexArray == brickRenderer.VertexArrayID)
+  {
+    const BrickInstance* b = (const BrickInstance*)&brickRenderer.cpu[0];
+    for(int i=0;i<c.instances;i++)
+      softwareInstance(mvp, brickRenderer.mesh, b[i].x, b[i].y, b[i].length, b[i].width, 0, b[i].R, b[i].G, b[i].B);
+  }
+  else if(c.vertexArray == bulletRenderer.VertexArrayID)
+  {
+    const BulletInstance* b = (const BulletInstance*)&bulletRenderer.cpu[0];
+    for(int i=0;i<c.instances;i++)
+      softwareInstance(mvp, bulletRenderer.mesh, b[i].x, b[i].y, 1, 1, b[i].angle, c.color[0], c.color[1], c.color[2]);
+  }
+  else if(c.vertexArray == fallingRenderer.VertexArrayID)
+  {
+    const FallingBrickInstance* b = (const FallingBrickInstance*)&fallingRenderer.cpu[0];
+    for(int i=0;i<c.instances;i++)
+    {
+      float y = b[i].brick.y;
+      const BrickFall& fall = b[i].fall;
+      if(fall.speed > 0)
+      {
+        // as in Sample_GL.vert
+        float k = max(0.0f, c.uniformValue - fall.baseTick);
+        float firstDrop = max(1.0f, ceilf((y + 2.2f) / fall.speed));
+        float drop = perTick(0.4);
+        y -= k*fall.speed + drop*max(0.0f, k - firstDrop + 1);
+      }
+      softwareInstance(mvp, unitRectangle, b[i].brick.x, y, b[i].brick.length, b[i].brick.width, 0,
+                       b[i].brick.R, b[i].brick.G, b[i].brick.B);
+    }
+  }
+  else if(c.vertexArray < objectsByVAO.size() && objectsByVAO[c.vertexArray])
+  {
+    const VAO* mesh = objectsByVAO[c.vertexArray];
+    for(int i=c.first;i<c.first+c.count;i++)
+      if(mesh->colors.empty())
+        softwareVertex(mvp, mesh->positions[2*i], mesh->positions[2*i+1], c.color[0], c.color[1], c.color[2]);
+      else
+        softwareVertex(mvp, mesh->positions[2*i], mesh->positions[2*i+1], mesh->colors[3*i], mesh->colors[3*i+1], mesh->colors[3*i+2]);
+  }
+
+  int circle = -1;
+  if(c.program == circleProgramID)
+  {
+    // window = origin + M * local; the fragment shading needs M inverted
+    float m00 = mvp[0][0]*0.5f*software.width, m01 = mvp[1][0]*0.5f*software.width;
+    float m10 = mvp[0][1]*0.5f*software.height, m11 = mvp[1][1]*0.5f*software.height;
+    float det = m00*m11 - m01*m10;
+    if(det == 0)
+      return;
+    SoftwareCircle s;
+    s.originX = (mvp[3][0]*0.5f + 0.5f)*software.width;
+    s.originY = (mvp[3][1]*0.5f + 0.5f)*software.height;
+    s.toLocal[0] = m11/det;
+    s.toLocal[1] = -m01/det;
+    s.toLocal[2] = -m10/det;
+    s.toLocal[3] = m00/det;
+    s.semicircle = c.uniformValue > 0.5f;
+    circle = software.circles.size();
+    software.circles.push_back(s);
+  }
+  softwareAssemble(c.primitive, circle);
+}
+
+void createSoftwareRenderer()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  software.avx2 = __builtin_cpu_supports("avx2");
+#endif
+  software.threads = max(1u, thread::hardware_concurrency());
+  for(int i=1;i<software.threads;i++)
+    software.workers.push_back(thread(softwareWorker));
+  glGenTextures(1, &software.Texture);
+  glGenFramebuffers(1, &software.Framebuffer);
+}
+
+/* Let the worker threads return and wait for them, before the process exits */
+void stopSoftwareRenderer()
+{
+  {
+    unique_lock<mutex> lock(software.lock);
+    software.stopping = true;
+  }
+  software.wake.notify_all();
+  for(size_t i=0;i<software.workers.size();i++)
+    software.workers[i].join();
+  software.workers.clear();
+}
+
+/* (Re)allocate the CPU framebuffer for a new size */
+void resizeSoftwareRenderer(int width, int height)
+{
+  if(width == software.width && height == software.height)
+    return;
+  software.width = width;
+  software.height = height;
+  software.tilesX = (width + SOFTWARE_TILE - 1) / SOFTWARE_TILE;
+  software.tilesY = (height + SOFTWARE_TILE - 1) / SOFTWARE_TILE;
+  software.color.assign(width*height, 0);
+  software.depth.assign(width*height, 1.0f);
+  software.bins.assign(software.tilesX*software.tilesY, vector<int>());
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, software.Texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glstats.bufferUploads++;
+  glBindFramebuffer(GL_FRAMEBUFFER, software.Framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, software.Texture, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+}
+
+/* Draw everything queued on the list into the CPU framebuffer, show it and empty the list */
+void rasterizeDrawList(DrawList& l)
+{
+  double start = wallClock();
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  resizeSoftwareRenderer(viewport[2], viewport[3]);
+  sortDrawList(l);
+  software.triangles.clear();
+  software.circles.clear();
+  for(size_t i=0;i<software.bins.size();i++)
+    software.bins[i].clear();
+  glm::mat4 identity(1.0f);
+  for(size_t i=0;i<l.entries.size();i++)
+  {
+    const DrawCommand& c = l.commands[l.entries[i].index];
+    softwareCommand(c, c.matrix >= 0 ? l.matrices[c.matrix] : identity);
+  }
+  software.triangleCount += software.triangles.size();
+
+  // the other threads pick up tiles as well until none are left
+  {
+    unique_lock<mutex> lock(software.lock);
+    software.nextTile = 0;
+    software.busy = software.threads - 1;
+    software.generation++;
+  }
+  software.wake.notify_all();
+  rasterizeTiles();
+  {
+    unique_lock<mutex> lock(software.lock);
+    while(software.busy > 0)
+      software.done.wait(lock);
+  }
+  l.commands.clear();
+  l.matrices.clear();
+
+  // headless runs read the frame straight from memory (see readFrame),
+  // unless it still has to be scaled up
+  if(!headless.enabled || renderScale.enabled)
+  {
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, software.Texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, software.width, software.height, GL_RGBA, GL_UNSIGNED_BYTE, &software.color[0]);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, software.Framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, screenFramebuffer);
+    glBlitFramebuffer(0, 0, software.width, software.height, 0, 0, software.width, software.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+  }
+  software.seconds += wallClock() - start;
+  software.frames++;
+}
+
+/* One tick of the game, sim.step long: timed events, then everything
+   that moves, then collisions */
+void updateGame (double xpos,double ypos)
+{
+  saveTickState();
+  sim.ticks++;
+  current_time = sim.ticks*sim.step;
+  // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
+  if(fire==1 && current_time-shoot_time>=0.5 && pause==0)
+  {
+    shoot_time=current_time;
+    spawnBullet(laserpos[2]*5);
+    playSound("mpg123 -vC sounds/1.mp3 &");
+    //createRectangle(0,0,0.4,0.05,1,1,0,7,bulletend);
+  }
+  if (current_time - last_update_time >=1 && pause==0) { // atleast 0.5s elapsed since last frame
+      // do something every 0.5 seconds ..
+      last_update_time = current_time;
+      srand(randomSeed());
+      int l,h;
+      float pos;
+      int color;
+      l=rand()%2;
+      if(l==0)
+      {
+        h=rand()%2;
+        srand(randomSeed());
+        pos=-2.392+1.224*((rand()%100)*1.0)/100;
+        if(h==0)
+        {
+          if(current_time - black_create_time >=2)
+          {
+          black_create_time = current_time;
+          color=0;
+          }
+          else
+          color=1;
+          //br.color=0; //black
+        }
+        else
+        {
+          color=1;
+          //br.color=1; //red
+        }
+      }
+      else{
+        h=rand()%2;
+        srand(randomSeed());
+        pos=0.488+1.744*((rand()%100)*1.0)/100;
+        if(h==0)
+        {
+          if(current_time - black_create_time>=2)
+          {
+          black_create_time=current_time;
+          color=0;
+         }
+         else
+         color=2;
+    //      br.color=0; //black
+        }
+        else
+        {
+          color=2;
+          //br.color=1; //green
+        }
+      }
+      addBrick(color,l,pos,4,0.2,0.6);
+  }
+
   if(zoomin==1)
   {
     if(zoom>0.5)
-    zoom-=0.01;
+    zoom-=perTick(0.01);
   }
   if(zoomout==1)
   {
     if(zoom<1)
-    zoom+=0.01;
+    zoom+=perTick(0.01);
   }
   if(panleft==1)
-    pan-=0.1;
+    pan-=perTick(0.1);
   if(panright==1)
-    pan+=0.1;
+    pan+=perTick(0.1);
   if(panup==1)
-    pany+=0.1;
+    pany+=perTick(0.1);
   if(pandown==1)
-    pany-=0.1;
+    pany-=perTick(0.1);
   if(rightclick==1)
   {
   pan+=xpos-mouse_x;
@@ -944,35 +3901,6 @@ void draw (double xpos,double ypos)
   pany+=-4+4*zoom-pany;
   if(4*zoom+pany>4)
     pany-=4*zoom+pany-4;
-  Matrices.projection = glm::ortho(-4.0f*zoom+pan, 4.0f*zoom+pan, -4.0f*zoom+pany, 4.0f*zoom+pany, 0.1f, 500.0f);
-
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
-
-  // Eye - Location of camera. Don't change unless you are sure!!
-  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  glm::vec3 target (0, 0, 0);
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  glm::vec3 up (0, 1, 0);
-
-  // Compute Camera matrix (view)
-  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-  //  Don't change unless you are sure!!
-  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
 
   // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
   // glPopMatrix ();
@@ -998,28 +3926,16 @@ void draw (double xpos,double ypos)
  }
   if(leftleft==1)
   {
-  binpos[1]-=0.02;
+  binpos[1]-=perTick(0.02);
   if(-1.75+binpos[1]<-2.928)
-  binpos[1]+=0.02;
+  binpos[1]+=perTick(0.02);
   }
   if(leftright==1)
   {
-    binpos[1]+=0.02;
+    binpos[1]+=perTick(0.02);
     if(-0.75+binpos[1]>-0.712)
-    binpos[1]-=0.02;
-  }
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translatebin= glm::translate (glm::vec3(-1+binpos[1]-0.75, -4, 0));        // glTranslatef
-//  glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatebin);// * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  if(redbin==1)
-  createRectangle (0,1.5,1,1.5,1,0,0,1,1);
-  else
-  createRectangle (0,1.5,1,1.5,1,0.3,0.3,1,1);
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(bin[1]);
+    binpos[1]-=perTick(0.02);
+  }
 // if(leftclick==1 && xpos>=1.5+binpos[2] && xpos<=1+1.5+binpos[2] && ypos<=2.5 && ypos>=-4 && redbin==0)
 // {
 //   greenbin=1;
@@ -1041,29 +3957,17 @@ if(greenbin==1)
  }
 }
 if(rightleft==1){
-  binpos[2]-=0.02;
+  binpos[2]-=perTick(0.02);
   if(1.5+binpos[2]<-0.264)
-  binpos[2]+=0.02;
+  binpos[2]+=perTick(0.02);
 }
 if(rightright==1)
 {
-  binpos[2]+=0.02;
+  binpos[2]+=perTick(0.02);
   //if(2.5+binpos[2]>3.2)
   if(2.5+binpos[2]>2.712)
-  binpos[2]-=0.02;
-}
-  Matrices.model = glm::mat4(1.0f);
-  translatebin = glm::translate (glm::vec3(1.5+binpos[2], -4, 0));        // glTranslatef
-  //  glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatebin);// * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  if(greenbin==1)
-  createRectangle (0,1.5,1,1.5,0,0.6,0,1,2);
-  else
-  createRectangle (0,1.5,1,1.5,0.1,1,0.1,1,2);
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(bin[2]);
+  binpos[2]-=perTick(0.02);
+}
 
 
 if(onlaser==1)
@@ -1080,201 +3984,72 @@ if(onlaser==1)
 }
 if(laserup==1)
 {
-  laserpos[1]+=0.02;
+  laserpos[1]+=perTick(0.02);
   if(laserpos[1]>3)
-  laserpos[1]-=0.02;
+  laserpos[1]-=perTick(0.02);
 }
 if(laserdown==1)
 {
-  laserpos[1]-=0.02;
+  laserpos[1]-=perTick(0.02);
   if(0.5+laserpos[1]<-2.5)
-  laserpos[1]+=0.02;
-}
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translatelaser = glm::translate (glm::vec3(0,0+laserpos[1], 0));        // glTranslatef
-  //  glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatelaser);// * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  if(onlaser==1)
-  {
-  createRectangle (-4,1,0.75,0.5,0,0,1,3,1);
-  }
-  else
-  {
-    createRectangle (-4,1,0.75,0.5,0.4,0.4,1,3,1);
-  }
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(laser[1]);
-
+  laserpos[1]+=perTick(0.02);
+}
 if(laserrotup==1)
 {
-  laserpos[2]+=0.1;
+  laserpos[2]+=perTick(0.1);
   if(laserpos[2]>18)
-  laserpos[2]-=0.1;
+  laserpos[2]-=perTick(0.1);
 }
 if(laserrotdown==1)
 {
-  laserpos[2]-=0.1;
+  laserpos[2]-=perTick(0.1);
   if(laserpos[2]<-18)
-  laserpos[2]+=0.1;
-}
-  Matrices.model = glm::mat4(1.0f);
-//  glm::mat4 translatelaser2= glm::translate (glm::vec3(-3.25,0.75, 0));
-  translatelaser = glm::translate (glm::vec3(-3.375,laserpos[1]+0.75, 0));        // glTranslatef
-  glm::mat4 rotatelaser = glm::rotate((float)(laserpos[2]*5*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatelaser * rotatelaser);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  if(onlaser==1)
-  createRectangle(0,0.125,0.5,0.25,0,0,1,3,2);
-  else
-  createRectangle(0,0.125,0.5,0.25,0.4,0.4,1,3,2);
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(laser[2]);
-
-
-  Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translatecircle1= glm::translate (glm::vec3(0.5,0,0));        // glTranslatef
-  translatelaser= glm::translate (glm::vec3(-3.375,laserpos[1]+0.75,0));        // glTranslatef
-  rotatelaser = glm::rotate((float)(laserpos[2]*5*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatelaser * rotatelaser* translatecircle1);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-if(onlaser==1)
-createcircle(3,0.125,0,0,1,0,0);
-else
-createcircle(3,0.125,0.4,0.4,1,0,0);
-      // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(circle[3]);
-
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translatecircle= glm::translate (glm::vec3(-0.5+binpos[1]-0.75,-2.5, 0));        // glTranslatef
-   glm::mat4 rotatecircle = glm::rotate((float)(-60*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatecircle * rotatecircle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(circle[1]);
-
-  Matrices.model = glm::mat4(1.0f);
-
-  translatecircle= glm::translate (glm::vec3(2+binpos[2],-2.5, 0));        // glTranslatef
-  rotatecircle = glm::rotate((float)(-60*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatecircle * rotatecircle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(circle[2]);
-
-
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translatemirror= glm::translate (glm::vec3(-0.75,0, 0));        // glTranslatef
- glm::mat4 rotatemirror = glm::rotate((float)(60*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatemirror * rotatemirror);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(mirror[1]);
-
-
-    Matrices.model = glm::mat4(1.0f);
-    translatemirror= glm::translate (glm::vec3(2.75,-1.5, 0));        // glTranslatef
-    rotatemirror = glm::rotate((float)(60*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translatemirror * rotatemirror);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(mirror[2]);
-
-    Matrices.model = glm::mat4(1.0f);
-    translatemirror= glm::translate (glm::vec3(-0.25,3,0));         // glTranslatef
-    rotatemirror = glm::rotate((float)(120*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translatemirror * rotatemirror);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(mirror[3]);
-
-    Matrices.model = glm::mat4(1.0f);
-    translatemirror= glm::translate (glm::vec3(3,2, 0));        // glTranslatef
-    rotatemirror = glm::rotate((float)(120*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translatemirror * rotatemirror);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(mirror[4]);
+  laserpos[2]+=perTick(0.1);
+}
  int i;
- int j;
- float leng,wids,c1,c2,c4,c3;
- if(current_time - bullet_update_time >=0.01)
+ // bullets and bricks move one step per tick
  {
-   bullet_update_time = current_time;
-   for(i=bulletstart;i!=(bulletend+1)%100;i=(i+1)%100)
+   for(i=0;i<bullets.count;i++)
    {
-     bullets[i][0]=bullets[i][0]+0.025*cos(bullets[i][4]*M_PI/180.0f);
-     bullets[i][1]=bullets[i][1]+0.025*sin(bullets[i][4]*M_PI/180.0f);
+     bullets.x[i]+=bullets.dx[i];
+     bullets.y[i]+=bullets.dy[i];
    }
 
-  i=bulletstart;
-   while((bullets[i][0]>4 || bullets[i][0]<-4 || bullets[i][1]>4 || bullets[i][1]<-4) && i<=bulletend)
+   // off the board: gone
+   for(i=0;i<bullets.count;)
    {
-     i=(i+1)%100;
-     bulletstart=(bulletstart+1)%100;
+     if(bullets.x[i]>4 || bullets.x[i]<-4 || bullets.y[i]>4 || bullets.y[i]<-4)
+     removeBullet(i);
+     else
+     i++;
    }
   }
 if(increasespeed==1)
-blockdist+=0.002;
+blockdist+=perTick(0.002);
 if(decreasespeed==1)
 {
-blockdist-=0.002;
+blockdist-=perTick(0.002);
 if(blockdist<0.02)
 blockdist=0.02;
 }
- if(current_time-show_time>=0.01)
  {
-  show_time=current_time;
-  for(i=leftstart;i!=(leftend+1)%100;i=(i+1)%100)
+  if(gpuFalling)
   {
-    leftbrick[i][2]-=(blockdist);
-    if(leftbrick[i][2]<=-2.2)
-    leftbrick[i][2]-=0.4;
+    // the vertex shader moves the bricks, only a new speed needs uploads
+    if(blockdist!=fallSpeed)
+    rebaseBricks();
+    fallTicks++;
   }
+  fallBricks();
 
-  i=leftstart;
-  while(int(leftbrick[i][2])<-7)
-  {
-    leftstart=(leftstart+1)%100;
-    i=(i+1)%100;
-  }
-  for(i=rightstart;i!=(rightend+1)%100;i=(i+1)%100)
-  {
-    rightbrick[i][2]-=blockdist;
-    if(rightbrick[i][2]<=-2.2)
-    rightbrick[i][2]-=0.4;
-  }
-  //collisionwithbrick();
-  i=rightstart;
-  while(int(rightbrick[i][2])<-7)
+  for(i=0;i<bricks.count;)
   {
-    rightstart=(rightstart+1)%100;
-    i=(i+1)%100;
+    if(int(bricks.y[i])<-7)
+    removeBrick(i);
+    else
+    i++;
   }
 }
-// for(i=leftstart;i!=(leftend+1)%100;i=(i+1)%100)
-// {
-// collisionwithleftbrick(leftbrick[i][1],leftbrick[i][2],leftbrick[i][2]-leftbrick[i][4],leftbrick[i][2],i);
-// collisionwithleftbrick(leftbrick[i][1]+leftbrick[i][3],leftbrick[i][2],leftbrick[i][2]-leftbrick[i][4],leftbrick[i][2],i);
-// }
  collisionwithbrick();
  collisionwithmirror(60,-0.75,0,0,0.664,1);
  collisionwithmirror(60,2.75,-1.5,-1.5,-0.85,2);
@@ -1282,275 +4057,200 @@ blockdist=0.02;
  collisionwithmirror(120,3,2,2,2.649,4);
 
 int q,w;
- for(i=leftstart;i!=(leftend+1)%100;i=(i+1)%100)
+ for(i=0;i<bricks.count;i++)
  {
-     q=checkinredbin(leftbrick[i][1],leftbrick[i][2]-leftbrick[i][4]);
-      w=checkinredbin(leftbrick[i][1]+leftbrick[i][3],leftbrick[i][2]-leftbrick[i][4]);
+     float x=bricks.x[i],y=bricks.y[i],length=bricks.length[i],width=bricks.width[i];
+     if(bricks.side[i]==0)
+     {
+     q=checkinredbin(x,y-width);
+     w=checkinredbin(x+length,y-width);
+     }
+     else
+     {
+     q=checkingreenbin(x,y-width);
+     w=checkingreenbin(x+length,y-width);
+     }
       if(q==1 && w==1)
       {
 
-        if(leftbrick[i][0]==0)
+        if(bricks.color[i]==0)
         {
-        system("mpg123 -vC sounds/5.mp3 &");
-        leftlives--;
+        playSound("mpg123 -vC sounds/5.mp3 &");
+        int& lives = bricks.side[i]==0 ? leftlives : rightlives;
+        lives--;
     //    cout<<lives<<endl;
-        if(leftlives==0)
+        if(lives==0)
         gameover=1;
         }
       else
       {
-      system("mpg123 -vC sounds/3.mp3 &");
-      if(leftvisit[i]==0)
+      playSound("mpg123 -vC sounds/3.mp3 &");
+      if(!bricks.caught[i])
       {
       score+=2;
       increaseblockdist();
-      leftvisit[i]=1;
+      bricks.caught[i]=true;
       }
       }
-      leftbrick[i][2]-=2;
+      setBrickY(i,y-2);
      }
-        Matrices.model = glm::mat4(1.0f);
-       translatemirror= glm::translate (glm::vec3(0,0, 0));        // glTranslate00f0
-      // rotatemirror = glm::rotate((float)(120*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-       Matrices.model *= (translatemirror);
-       MVP = VP * Matrices.model;
-       glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-       if(leftbrick[i][0]==0)
-       createRectangle(leftbrick[i][1],leftbrick[i][2],leftbrick[i][3],leftbrick[i][4],0,0,0,5,i);
-       if(leftbrick[i][0]==1)
-       createRectangle(leftbrick[i][1],leftbrick[i][2],leftbrick[i][3],leftbrick[i][4],1,0,0,5,i);
-      // draw3DObject draws the VAO given to it using current MVP matrix
-
-       draw3DObject(leftside[i]);
  }
- for(i=rightstart;i!=(rightend+1)%100;i=(i+1)%100)
- {
-  q=checkingreenbin(rightbrick[i][1],rightbrick[i][2]-rightbrick[i][4]);
-   w=checkingreenbin(rightbrick[i][1]+rightbrick[i][3],rightbrick[i][2]-rightbrick[i][4]);
-   if(q==1 && w==1)
-   {
+ if(score<0)
+ score=0;
+}
 
-  if(rightbrick[i][0]==0)
-  {
-    system("mpg123 -vC sounds/5.mp3 &");
-    rightlives--;
-    //cout<<lives<<endl;
-    if(rightlives==0)
-    gameover=1;
-  //gameover=1;
-   }
-  else
+/* Run the ticks that the clock time since the last frame covers; the rest
+   carries over to the next frame */
+void advanceSimulation (double xpos,double ypos)
+{
+  double now = gameClock();
+  double elapsed = now - sim.lastClock;
+  sim.lastClock = now;
+  // paused time is not made up afterwards
+  if(pause==1)
+    return;
+  sim.accumulator += elapsed;
+  int ticks = 0;
+  // the tolerance lets a frame exactly sim.step long run its tick despite rounding
+  while(sim.accumulator >= sim.step - 1e-9 && gameover==0)
   {
-    system("mpg123 -vC sounds/3.mp3 &");
-    if(rightvisit[i]==0)
-     {
-       //cout<<"s\n";
-      rightvisit[i]=1;
-      score+=2;
-      increaseblockdist();
-     }
+    if(ticks == SIM_MAX_TICKS)
+    {
+      sim.droppedSeconds += sim.accumulator;
+      sim.accumulator = 0;
+      sim.clampedFrames++;
+      break;
+    }
+    updateGame(xpos, ypos);
+    sim.accumulator -= sim.step;
+    ticks++;
   }
-  rightbrick[i][2]-=2;
-   }
-       Matrices.model = glm::mat4(1.0f);
-       translatemirror= glm::translate (glm::vec3(0,0,0));        // glTranslate00f0
-      // rotatemirror = glm::rotate((float)(120*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-       Matrices.model *= (translatemirror);
-       MVP = VP * Matrices.model;
-       glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-       if(rightbrick[i][0]==0)
-       createRectangle(rightbrick[i][1],rightbrick[i][2],rightbrick[i][3],rightbrick[i][4],0,0,0,6,i);
-       if(rightbrick[i][0]==2)
-       createRectangle(rightbrick[i][1],rightbrick[i][2],rightbrick[i][3],rightbrick[i][4],0,1,0,6,i);
-       // draw3DObject draws the VAO given to it using current MVP matrix
-
-       draw3DObject(rightside[i]);
- }
+  sim.frames++;
+  sim.mostTicks = max(sim.mostTicks, ticks);
+  renderAlpha = interpolate ? min(1.0, max(0.0, sim.accumulator / sim.step)) : 1;
+}
 
- for(i=bulletstart;i!=(bulletend+1)%100;i=(i+1)%100)
- {
-//   cout<<bullets[i][4]<<endl;
-   Matrices.model = glm::mat4(1.0f);
-   translatemirror= glm::translate (glm::vec3(bullets[i][0],bullets[i][1],0));        // glTranslate00f0
-   rotatemirror = glm::rotate((float)(bullets[i][4]*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-   Matrices.model *= (translatemirror*rotatemirror);
-   MVP = VP * Matrices.model;
-   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-   createRectangle(0,0,0.4,0.05,1,1,0,7,i);
-   // draw3DObject draws the VAO given to it using current MVP matrix
-   draw3DObject(bullet[i]);
- }
- for(i=0;i<leftlives;i++)
- {
-   Matrices.model = glm::mat4(1.0f);
-   glm::mat4 translatelive = glm::translate (glm::vec3(0,-i*0.3, 0));        // glTranslatef
-   glm::mat4 rotatelive = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-   Matrices.model *= (translatelive * rotatelive);
-   MVP = VP * Matrices.model;
-   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-   createlives(-3.7,-2.6,i);
-   draw3DObject(lives[i]);
- }
+/* Render the game between its last two ticks; updateGame moves it */
+void draw ()
+{
+  if(pause==1)
+  return;
+  // projection and VP are only recomputed when zoom or pan moved
+  updateCamera();
+  view.left = -4.0f*zoom+pan;
+  view.right = 4.0f*zoom+pan;
+  view.bottom = -4.0f*zoom+pany;
+  view.top = 4.0f*zoom+pany;
 
- for(i=0;i<rightlives;i++)
- {
-   Matrices.model = glm::mat4(1.0f);
-   glm::mat4 translatelive = glm::translate (glm::vec3(0,-i*0.3, 0));        // glTranslatef
-   glm::mat4 rotatelive = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-   Matrices.model *= (translatelive * rotatelive);
-   MVP = VP * Matrices.model;
-   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-   createlives(3.3,-2.464,i+3);
-   draw3DObject(lives[i+3]);
- }
+  beginScaledFrame();
 
- createRectangle(2.5,3.872,0.2,0.02,0,0,0,9,1);
- createRectangle(2.5,3.871,0.01,0.2,0,0,0,9,2);
- createRectangle(2.5,3.671,0.2,0.015,0,0,0,9,3);
- createRectangle(2.7,3.656,0.01,0.2,0,0,0,9,4);
- createRectangle(2.5,3.456,0.2,0.015,0,0,0,9,5);
+  // clear the color and depth in the frame buffer (rasterizeTile does its own)
+  if(!softwareRender)
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // use the loaded shader program
+  // Don't change unless you know what you are doing
+  setProgram (programID);
+
+  // the cannon is batched here and drawn with one call by batchFlush at the end
+  batchBegin();
+  setPose(cannonBase, 0, renderLaserpos(1), 0);
+  if(onlaser==1)
+  {
+  batchRectangle (-4,1,0.75,0.5,0,0,1,transformWorld(cannonBase));
+  }
+  else
+  {
+    batchRectangle (-4,1,0.75,0.5,0.4,0.4,1,transformWorld(cannonBase));
+  }
 
- createRectangle(2.725,3.872,0.2,0.02,0,0,0,9,6);
- createRectangle(2.725,3.871,0.02,0.45,0,0,0,9,7);
- createRectangle(2.725,3.436,0.2,0.015,0,0,0,9,8);
+  setPose(cannonBarrel, -3.375, renderLaserpos(1)+0.75, renderLaserpos(2)*5);
+  if(onlaser==1)
+  batchRectangle(0,0.125,0.5,0.25,0,0,1,transformWorld(cannonBarrel));
+  else
+  batchRectangle(0,0.125,0.5,0.25,0.4,0.4,1,transformWorld(cannonBarrel));
 
- createRectangle(2.967,3.872,0.2,0.02,0,0,0,9,9);
- createRectangle(2.967,3.871,0.02,0.45,0,0,0,9,10);
- createRectangle(2.967,3.436,0.2,0.015,0,0,0,9,11);
- createRectangle(3.167,3.872,0.015,0.45,0,0,0,9,12);
 
- createRectangle(3.22,3.872,0.015,0.45,0,0,0,9,13);
- createRectangle(3.235,3.872,0.2,0.02,0,0,0,9,14);
- createRectangle(3.435,3.871,0.015,0.23,0,0,0,9,15);
- createRectangle(3.22,3.642,0.23,0.015,0,0,0,9,16);
- createRectangle(0,0,0.32,0.0152,0,0,0,9,17);
+  // bins, rims and mirrors come from the static layer, redrawn only when they move
+  compositeStaticLayer();
 
- createRectangle(3.5,3.872,0.015,0.46,0,0,0,9,18);
- createRectangle(3.515,3.872,0.2,0.015,0,0,0,9,19);
- createRectangle(3.515,3.642,0.2,0.015,0,0,0,9,20);
- createRectangle(3.515,3.414,0.2,0.015,0,0,0,9,21);
-float ha,a,b;
-for(i=1;i<=21;i++)
-{
-  if(i==17)
-  {
-  ha=315;
-  a=3.22;
-  b=3.642;
-}
+setDrawLayer(LAYER_CANNON_TIP);
+if(onlaser==1)
+drawCircle(cannonTip,0,0,1);
+else
+drawCircle(cannonTip,0.4,0.4,1);
+
+ // draws both sides with one instanced call
+ setDrawLayer(LAYER_BRICKS);
+ drawBricks();
+
+ // bullets are rotated in the vertex shader, one instanced call for all of them
+ setDrawLayer(LAYER_BULLETS);
+ drawBullets();
+ // lives, score, level and FPS: one draw, rebuilt only when one of them changes
+ drawHUD();
+  setDrawLayer(LAYER_CANNON);
+  batchFlush();
+
+  // everything above was queued: sort it and draw it
+  if(softwareRender)
+    rasterizeDrawList(frameList);
   else
   {
-  ha=0;a=0;b=0;
-}
- Matrices.model = glm::mat4(1.0f);
- translatemirror= glm::translate (glm::vec3(a,b,0));        // glTranslate00f0
- rotatemirror = glm::rotate((float)(ha*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- Matrices.model *= (translatemirror*rotatemirror);
- MVP = VP * Matrices.model;
- glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- draw3DObject(segment[i]);
- }
- //cout<<score<<endl;
- if(score<0)
- score=0;
- int lop,dig=-1,score1,sx=0,sy=0;
- lop=score;
-// cout<<score<<endl;
- while(lop>0)
- {
-   lop/=10;
-   dig++;
- }
- score1=score;
-   for(i=22;i<=28;i++)
-   {
-     createRectangle(0,0,0.22,0.01,0,0,0,9,i);
-   }
-   if(dig==-1)
- 			dig=0;createRectangle(0,0.125,0.5,0.25,0,0,1,3,2);
-
- 		for(int a=dig;a>=0;a--){
- 			int p=score1%10;
- 			if(p==0||p==4||p==5||p==6||p==8||p==9){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment1 = glm::translate (glm::vec3(2.69+a*0.4, 2.4+0.5, 0));        // glTranslatef
- 				glm::mat4 rotatesegment1 = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment1 * rotatesegment1);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[22]);
- 			}
- 			if(p==0||p==2||p==6||p==8){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment2 = glm::translate (glm::vec3(2.69+a*0.4, 2.21+0.5, 0));        // glTranslatef
- 				glm::mat4 rotatesegment2 = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment2 * rotatesegment2);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[23]);
- 			}
- 			if(p==0||p==2||p==3||p==5||p==6||p==8){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment3 = glm::translate (glm::vec3(2.69+a*0.4, 2.2+0.5, 0));        // glTranslatef
- 				glm::mat4 rotatesegment3 = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment3 * rotatesegment3);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[24]);
- 			}
- 			if(p==0||p==1||p==3||p==4||p==5||p==6||p==7||p==8||p==9){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment4 = glm::translate (glm::vec3(2.93+a*0.4, 2.21+0.5, 0));        // glTranslatef
- 				glm::mat4 rotatesegment4 = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment4 * rotatesegment4);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[25]);
- 			}
- 			if(p==0||p==1||p==2||p==3||p==4||p==7||p==8||p==9){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment5 = glm::translate (glm::vec3(2.93+a*0.4, 2.4+0.5, 0));        // glTranslatef
- 				glm::mat4 rotatesegment5 = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment5 * rotatesegment5);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[26]);
- 			}
- 			if(p==0||p==2||p==3||p==5||p==6||p==7||p==8||p==9){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment6 = glm::translate (glm::vec3(2.69+a*0.4, 2.55+0.56, 0));        // glTranslatef
- 				glm::mat4 rotatesegment6 = glm::rotate((float)(	0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment6 * rotatesegment6);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[27]);
- 			}
- 			if(p==8 ||p==2||p==5||p==3||p==4||p==6||p==9){
- 				Matrices.model = glm::mat4(1.0f);
-
- 				glm::mat4 translatesegment7 = glm::translate (glm::vec3(2.69+a*0.4, 2.37+0.5, 0));        // glTranslatef
- 				glm::mat4 rotatesegment7 = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
- 				Matrices.model *= (translatesegment7 * rotatesegment7);
- 				MVP = VP * Matrices.model;
- 				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- 				draw3DObject(segment[28]);
- 			}
- 			score1=score1/10;
- 		}
+    submitDrawList(frameList);
+    batchFence();
+  }
+  presentScaledFrame();
   float increments = 1;
   //camera_rotation_angle++; // Simulating camera rotation
   //triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
   //rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_ruwill sned ot_status;
 }
 
+void printGLStats()
+{
+    printf("GL objects created: %ld, buffer uploads: %ld\n", glstats.objectsCreated, glstats.bufferUploads);
+    printf("Frames drawn: %ld, steady-state frames that allocated: %ld\n", glstats.framesDrawn, glstats.allocatingFrames);
+    if(glstats.framesDrawn > 0)
+      printf("Draw calls per frame: %.1f\n", (double)glstats.drawCalls / glstats.framesDrawn);
+    if(glstats.framesDrawn > 0)
+      printf("GL state cache: %.1f calls issued, %.1f redundant calls skipped per frame\n",
+             (double)glstate.totalIssued / glstats.framesDrawn, (double)glstate.totalSkipped / glstats.framesDrawn);
+    if(glstats.framesDrawn > 0)
+      printf("Brick instance data: %.1f bytes per frame (%s)\n", (double)glstats.brickBytes / glstats.framesDrawn,
+             gpuFalling ? "moved by the vertex shader" : "streamed every frame");
+    if(glstats.framesDrawn > 0)
+      printf("Culling: %.1f visible, %.1f culled objects per frame\n",
+             (double)glstats.visible / glstats.framesDrawn, (double)glstats.culled / glstats.framesDrawn);
+    if(glstats.framesDrawn > 0)
+      printf("Draw lists: %.1f commands, %.1f program/VAO/fill changes as queued, %.1f sorted per frame\n",
+             (double)glstats.drawCommands / glstats.framesDrawn, (double)glstats.changesUnsorted / glstats.framesDrawn,
+             (double)glstats.changesSorted / glstats.framesDrawn);
+    if(glstats.framesDrawn > 0)
+      printf("Transforms: %.2f matrix multiplies per frame\n", (double)glstats.matrixMultiplies / glstats.framesDrawn);
+    printf("HUD: rebuilt %ld times in %ld frames\n", hud.rebuilds, glstats.framesDrawn);
+    printf("Static layer: rendered %ld times in %ld frames\n", staticLayer.renders, glstats.framesDrawn);
+    printf("Sprite batcher: %s ring, %ld stalled frames, %ld dropped vertices\n",
+           softwareRender ? "CPU memory" : batcher.persistent ? "persistent-mapped" : "fenced", batcher.stalls, batcher.dropped);
+    if(glstats.mapFailures > 0)
+      printf("Buffer maps: %ld failed, the batch or instances they were for were not drawn\n", glstats.mapFailures);
+    if(renderScale.enabled && renderScale.frame > 0)
+      printf("Render scale: %.1f%% on average, %d%% at the end, %ld changes, %.2f ms smoothed frame time\n",
+             renderScale.percentSum / renderScale.frame, renderScale.percent, renderScale.changes, 1000*renderScale.frameTime);
+    if(softwareRender && software.frames > 0)
+      printf("Software rasterizer: %.3f ms per frame, %.1f triangles per frame, %d threads, %s edge tests\n",
+             1000*software.seconds / software.frames, (double)software.triangleCount / software.frames,
+             software.threads, software.avx2 ? "AVX2" : "scalar");
+    if(sim.frames > 0)
+      printf("Simulation: %ld ticks of %.1f ms, %.2f per frame (at most %d), %ld frames clamped, %.3f s dropped\n",
+             sim.ticks, 1000*sim.step, (double)sim.ticks / sim.frames, sim.mostTicks, sim.clampedFrames, sim.droppedSeconds);
+    printf("Entities: at most %d bullets and %d bricks at once\n", bulletSlots.peak, brickSlots.peak);
+    if(collisions.pairs > 0)
+      printf("Collisions: %ld bullet-brick pairs tested, %.1f million per second with the %s kernel\n",
+             collisions.pairs, collisions.pairs / collisions.seconds / 1e6, kernelNames[collisions.kernel]);
+    printPacingStats();
+}
+
 /* Initialise glfw window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
 GLFWwindow* initGLFW (int width, int height)
@@ -1576,7 +4276,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    applyPacing();
 
     /* --- register callbacks with GLFW --- */
 
@@ -1600,10 +4300,663 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+/* Create a surfaceless EGL context and an offscreen framebuffer for draw()
+   to render into, in place of initGLFW. Needs EGL_MESA_platform_surfaceless
+   or a default EGL display, and EGL_KHR_surfaceless_context */
+/* Open libEGL and fill in egl; false if the library or a function is missing */
+bool loadEGL ()
+{
+    void* library = dlopen("libEGL.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!library)
+        return false;
+    egl.GetProcAddress = (PFNEGLGETPROCADDRESSPROC) dlsym(library, "eglGetProcAddress");
+    egl.GetDisplay = (PFNEGLGETDISPLAYPROC) dlsym(library, "eglGetDisplay");
+    egl.Initialize = (PFNEGLINITIALIZEPROC) dlsym(library, "eglInitialize");
+    egl.BindAPI = (PFNEGLBINDAPIPROC) dlsym(library, "eglBindAPI");
+    egl.ChooseConfig = (PFNEGLCHOOSECONFIGPROC) dlsym(library, "eglChooseConfig");
+    egl.CreateContext = (PFNEGLCREATECONTEXTPROC) dlsym(library, "eglCreateContext");
+    egl.MakeCurrent = (PFNEGLMAKECURRENTPROC) dlsym(library, "eglMakeCurrent");
+    egl.DestroyContext = (PFNEGLDESTROYCONTEXTPROC) dlsym(library, "eglDestroyContext");
+    return egl.GetProcAddress && egl.GetDisplay && egl.Initialize && egl.BindAPI &&
+           egl.ChooseConfig && egl.CreateContext && egl.MakeCurrent && egl.DestroyContext;
+}
+
+void initHeadless (int width, int height)
+{
+    if (!loadEGL()) {
+        fprintf(stderr, "Headless: could not load libEGL.so.1\n");
+        exit(EXIT_FAILURE);
+    }
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) egl.GetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = egl.GetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !egl.Initialize(display, &major, &minor)) {
+        fprintf(stderr, "Headless: no EGL display\n");
+        exit(EXIT_FAILURE);
+    }
+    egl.BindAPI(EGL_OPENGL_API);
+
+    // nothing is ever drawn to an EGL surface, so any surface type will do
+    EGLint configAttributes[] = {EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint configs = 0;
+    egl.ChooseConfig(display, configAttributes, &config, 1, &configs);
+    EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = configs ? egl.CreateContext(display, config, EGL_NO_CONTEXT, contextAttributes) : EGL_NO_CONTEXT;
+    if (context == EGL_NO_CONTEXT || !egl.MakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        fprintf(stderr, "Headless: could not make a surfaceless OpenGL 3.3 core context current\n");
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) egl.GetProcAddress);
+    headless.display = display;
+    headless.config = config;
+    headless.context = context;
+    headless.width = width;
+    headless.height = height;
+
+    glGenRenderbuffers(1, &headless.ColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.ColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &headless.DepthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.DepthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glGenFramebuffers(1, &headless.Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.ColorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.DepthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Headless: framebuffer incomplete\n");
+        exit(EXIT_FAILURE);
+    }
+    screenFramebuffer = headless.Framebuffer;
+}
+
+/* Read the headless framebuffer back as top-down RGB rows */
+vector<unsigned char> readFrame ()
+{
+    vector<unsigned char> pixels(headless.width*headless.height*3);
+    if (softwareRender && !renderScale.enabled) {
+        for (int y=0; y<headless.height; y++)
+            for (int x=0; x<headless.width; x++) {
+                uint32_t c = software.color[(headless.height-1-y)*software.width + x];
+                for (int i=0; i<3; i++)
+                    pixels[(y*headless.width + x)*3 + i] = c >> 8*i & 0xFF;
+            }
+        return pixels;
+    }
+    vector<unsigned char> rows(pixels.size());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, headless.Framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, headless.width, headless.height, GL_RGB, GL_UNSIGNED_BYTE, &rows[0]);
+    int stride = headless.width*3;
+    for (int y=0; y<headless.height; y++)
+        memcpy(&pixels[y*stride], &rows[(headless.height-1-y)*stride], stride);
+    return pixels;
+}
+
+bool writePPM (const char* path, const vector<unsigned char>& pixels, int width, int height)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    fwrite(&pixels[0], 1, pixels.size(), file);
+    fclose(file);
+    return true;
+}
+
+/* Binary PPM with maxval 255, as written by writePPM */
+bool readPPM (const char* path, vector<unsigned char>& pixels, int& width, int& height)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    int maxval;
+    bool ok = fscanf(file, "P6 %d %d %d", &width, &height, &maxval) == 3 && maxval == 255 && fgetc(file) != EOF;
+    if (ok) {
+        pixels.resize(width*height*3);
+        ok = fread(&pixels[0], 1, pixels.size(), file) == pixels.size();
+    }
+    fclose(file);
+    return ok;
+}
+
+/* End of a headless run: report the timings, dump the last frame and check
+   it against the golden image. Returns the exit status */
+int finishHeadless ()
+{
+    printf("Headless: %ld frames, %.3f ms per frame from draw() to glFinish\n", headless.frame,
+           headless.frame ? 1000*headless.renderSeconds/headless.frame : 0.0);
+    if (!headless.dumpPath && !headless.goldenPath)
+        return 0;
+
+    vector<unsigned char> frame = readFrame();
+    if (headless.dumpPath && !writePPM(headless.dumpPath, frame, headless.width, headless.height)) {
+        fprintf(stderr, "Headless: could not write %s\n", headless.dumpPath);
+        return EXIT_FAILURE;
+    }
+    if (!headless.goldenPath)
+        return 0;
+
+    vector<unsigned char> golden;
+    int width, height;
+    if (!readPPM(headless.goldenPath, golden, width, height)) {
+        fprintf(stderr, "Headless: could not read %s\n", headless.goldenPath);
+        return EXIT_FAILURE;
+    }
+    if (width != headless.width || height != headless.height) {
+        fprintf(stderr, "Headless: golden image is %dx%d, frame is %dx%d\n", width, height, headless.width, headless.height);
+        return EXIT_FAILURE;
+    }
+    long differing = 0;
+    for (size_t i=0; i<frame.size(); i+=3)
+        for (int c=0; c<3; c++)
+            if (abs(frame[i+c] - golden[i+c]) > GOLDEN_TOLERANCE) {
+                differing++;
+                break;
+            }
+    printf("Golden image: %ld of %d pixels differ by more than %d\n", differing, width*height, GOLDEN_TOLERANCE);
+    return differing ? EXIT_FAILURE : 0;
+}
+
+/* Frame capture (--capture, --capture-pipe): every frame is read into a
+   pixel buffer object with glReadPixels, which only queues the copy, and a
+   fence marks when it is done. CAPTURE_LATENCY frames later the copy has
+   long finished: the buffer is mapped and handed to a writer thread, which
+   converts and writes the frame straight from the mapping. Neither the GPU
+   nor the disk stalls the render loop, and the loop never touches the
+   pixels itself. A buffer is unmapped once the writer is done with it, by
+   the time it comes round again.
+
+   On a software GL driver glReadPixels copies the frame then and there, PBO
+   or not, and that copy costs about 1 ms at 1000x1000. Headless frames are
+   drawn into an FBO, so there they go into a ring of renderbuffers instead:
+   the writer reads each one back itself on a context shared with the render
+   loop, and the loop only sets a fence */
+#define CAPTURE_BUFFERS 8   // pixel buffers, in flight or waiting for the writer
+#define CAPTURE_LATENCY 2   // frames between a readback and mapping its buffer
+
+enum CaptureFormat { CAPTURE_RAW, CAPTURE_PPM, CAPTURE_PNG };
+
+struct CaptureFrame {
+    const unsigned char* pixels;  // RGBA8, bottom row first as read from GL
+    vector<unsigned char> copy;   // holds the pixels when they do not come from GL
+    int width, height;
+    long number;
+    GLsync fence;
+    bool pending;                 // readback queued, not yet mapped
+    bool mapped;
+};
+
+struct Capture {
+    const char* pattern;        // --capture: file name with a %d for the frame number
+    const char* pipeCommand;    // --capture-pipe: raw RGB frames go to this command's stdin
+    bool enabled;
+    CaptureFormat format;
+    FILE* pipe;
+    int width, height;
+    GLuint buffers[CAPTURE_BUFFERS];
+    bool fromMemory;            // headless --software: frames are copied, not read back
+    bool sharedRead;            // headless: the writer reads targets[] itself
+    EGLContext readContext;
+    GLuint targets[CAPTURE_BUFFERS];  // frame n is drawn into targets[n % CAPTURE_BUFFERS]
+    // frame n uses frames[n % CAPTURE_BUFFERS]; head..tail-1 are with the writer
+    CaptureFrame frames[CAPTURE_BUFFERS];
+    long frame;
+    long head, tail;
+    bool stopping;
+    mutex lock;
+    condition_variable ready, returned;
+    thread writer;
+    // benchmark
+    double loopSeconds;         // spent in captureFrame on the render loop
+    double writerSeconds;
+    long written, fenceWaits, writerWaits, failures;
+} capture;
+
+uint32_t crcTable[256];
+
+uint32_t crc32 (uint32_t crc, const unsigned char* data, size_t length)
+{
+    if (!crcTable[1])
+        for (uint32_t n=0; n<256; n++) {
+            uint32_t c = n;
+            for (int k=0; k<8; k++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            crcTable[n] = c;
+        }
+    crc = ~crc;
+    for (size_t i=0; i<length; i++)
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t adler32 (uint32_t adler, const unsigned char* data, size_t length)
+{
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (length > 0) {
+        // 5552 bytes is the most that cannot overflow b before the modulo
+        size_t n = min(length, (size_t)5552);
+        length -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+void putBigEndian (vector<unsigned char>& out, uint32_t value)
+{
+    for (int i=3; i>=0; i--)
+        out.push_back(value >> 8*i & 0xFF);
+}
+
+void writePNGChunk (FILE* file, const char* type, const unsigned char* data, size_t length)
+{
+    vector<unsigned char> header;
+    putBigEndian(header, length);
+    header.insert(header.end(), type, type+4);
+    uint32_t crc = crc32(crc32(0, &header[4], 4), data, length);
+    fwrite(&header[0], 1, 8, file);
+    if(length)  // IEND has no data to write, and no pointer to it
+        fwrite(data, 1, length, file);
+    vector<unsigned char> trailer;
+    putBigEndian(trailer, crc);
+    fwrite(&trailer[0], 1, 4, file);
+}
+
+/* RGB rows, top row first, as a PNG with stored deflate blocks: without
+   zlib we do not compress, which also keeps the writer thread cheap */
+bool writePNG (const char* path, const vector<unsigned char>& rgb, int width, int height, vector<unsigned char>& scratch)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+    unsigned char header[13] = {0};
+    for (int i=0; i<4; i++) {
+        header[i] = width >> 8*(3-i) & 0xFF;
+        header[4+i] = height >> 8*(3-i) & 0xFF;
+    }
+    header[8] = 8;  // bits per channel
+    header[9] = 2;  // RGB
+    writePNGChunk(file, "IHDR", header, sizeof(header));
+
+    // each row starts with filter type 0 (none)
+    size_t stride = width*3, rawSize = (stride+1)*height;
+    size_t blocks = (rawSize + 65534) / 65535;
+    scratch.clear();
+    scratch.reserve(2 + rawSize + 5*blocks + 4);
+    scratch.push_back(0x78);
+    scratch.push_back(0x01);
+    size_t row = 0, column = 0;  // column 0 is the filter byte
+    for (size_t done=0; done<rawSize; ) {
+        size_t length = min(rawSize-done, (size_t)65535);
+        done += length;
+        scratch.push_back(done == rawSize);
+        scratch.push_back(length & 0xFF);
+        scratch.push_back(length >> 8);
+        scratch.push_back(~length & 0xFF);
+        scratch.push_back(~length >> 8 & 0xFF);
+        while (length > 0) {
+            size_t n = column == 0 ? 1 : min(length, stride+1-column);
+            if (column == 0)
+                scratch.push_back(0);
+            else
+                scratch.insert(scratch.end(), &rgb[row*stride + column-1], &rgb[row*stride + column-1] + n);
+            column += n;
+            length -= n;
+            if (column > stride) {
+                column = 0;
+                row++;
+            }
+        }
+    }
+    uint32_t adler = 1;
+    const unsigned char filter = 0;
+    for (int y=0; y<height; y++)
+        adler = adler32(adler32(adler, &filter, 1), &rgb[y*stride], stride);
+    putBigEndian(scratch, adler);
+    writePNGChunk(file, "IDAT", &scratch[0], scratch.size());
+    writePNGChunk(file, "IEND", NULL, 0);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+/* Writer thread: flips and converts the frames handed over and writes them out */
+void captureWriter ()
+{
+    vector<unsigned char> rgb, scratch;
+    char path[1024];
+#ifdef __linux__
+    // the writer only has to keep up on average: let the render loop go
+    // first (on Linux this sets the nice value of the calling thread only)
+    setpriority(PRIO_PROCESS, 0, 10);
+#endif
+    vector<unsigned char> rgba;
+    GLuint readFramebuffer = 0;
+    if (capture.sharedRead) {
+        egl.MakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, capture.readContext);
+        // framebuffers are not shared between contexts, renderbuffers are
+        glGenFramebuffers(1, &readFramebuffer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    }
+    while (true) {
+        {
+            unique_lock<mutex> lock(capture.lock);
+            while (capture.head == capture.tail && !capture.stopping)
+                capture.ready.wait(lock);
+            if (capture.head == capture.tail)
+                break;
+        }
+        double start = wallClock();
+        int slot = capture.head % CAPTURE_BUFFERS;
+        CaptureFrame& frame = capture.frames[slot];
+        int width = frame.width, height = frame.height;
+        if (capture.sharedRead) {
+            glClientWaitSync(frame.fence, 0, 1000000000);
+            glDeleteSync(frame.fence);
+            glFramebufferRenderbuffer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, capture.targets[slot]);
+            rgba.resize(width*height*4);
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0]);
+            frame.pixels = &rgba[0];
+        }
+        rgb.resize(width*height*3);
+        for (int y=0; y<height; y++) {
+            const unsigned char* source = frame.pixels + (height-1-y)*width*4;
+            unsigned char* destination = &rgb[y*width*3];
+            for (int x=0; x<width; x++)
+                for (int i=0; i<3; i++)
+                    destination[x*3+i] = source[x*4+i];
+        }
+        bool ok = true;
+        if (capture.pipe)
+            ok = fwrite(&rgb[0], 1, rgb.size(), capture.pipe) == rgb.size();
+        else {
+            snprintf(path, sizeof(path), capture.pattern, frame.number);
+            if (capture.format == CAPTURE_PPM)
+                ok = writePPM(path, rgb, width, height);
+            else if (capture.format == CAPTURE_PNG)
+                ok = writePNG(path, rgb, width, height, scratch);
+            else {
+                FILE* file = fopen(path, "wb");
+                ok = file && fwrite(&rgb[0], 1, rgb.size(), file) == rgb.size();
+                if (file)
+                    fclose(file);
+            }
+        }
+        {
+            unique_lock<mutex> lock(capture.lock);
+            capture.written++;
+            if (!ok)
+                capture.failures++;
+            capture.writerSeconds += wallClock() - start;
+            capture.head++;
+        }
+        capture.returned.notify_one();
+    }
+    if (capture.sharedRead) {
+        glDeleteFramebuffers(1, &readFramebuffer);
+        egl.MakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    }
+}
+
+void startCapture ()
+{
+    if (!capture.pattern && !capture.pipeCommand)
+        return;
+    capture.enabled = true;
+    if (capture.pipeCommand) {
+        capture.pipe = popen(capture.pipeCommand, "w");
+        if (!capture.pipe) {
+            fprintf(stderr, "Capture: could not run %s\n", capture.pipeCommand);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        const char* extension = strrchr(capture.pattern, '.');
+        if (extension && !strcmp(extension, ".ppm"))
+            capture.format = CAPTURE_PPM;
+        else if (extension && !strcmp(extension, ".png"))
+            capture.format = CAPTURE_PNG;
+        else
+            capture.format = CAPTURE_RAW;
+    }
+    capture.fromMemory = softwareRender && headless.enabled && !renderScale.enabled;
+    if (headless.enabled && !softwareRender) {
+        EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+        };
+        capture.readContext = egl.CreateContext(headless.display, headless.config, headless.context, contextAttributes);
+        capture.sharedRead = capture.readContext != EGL_NO_CONTEXT;
+    }
+    if (capture.sharedRead) {
+        glGenRenderbuffers(CAPTURE_BUFFERS, capture.targets);
+        glstats.objectsCreated += CAPTURE_BUFFERS;
+        for (int i=0; i<CAPTURE_BUFFERS; i++) {
+            glBindRenderbuffer(GL_RENDERBUFFER, capture.targets[i]);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, headless.width, headless.height);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, capture.targets[0]);
+        glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+    }
+    else if (!capture.fromMemory) {
+        // only frames on the window (or scaled up from --software) go through the PBO ring
+        glGenBuffers(CAPTURE_BUFFERS, capture.buffers);
+        glstats.objectsCreated += CAPTURE_BUFFERS;
+    }
+    capture.writer = thread(captureWriter);
+}
+
+/* Hand frame 'number' to the writer */
+void handToWriter (long number)
+{
+    {
+        unique_lock<mutex> lock(capture.lock);
+        capture.tail = number + 1;
+    }
+    capture.ready.notify_one();
+}
+
+/* Wait until the writer has written every frame before 'number' */
+void waitForWriter (long number)
+{
+    unique_lock<mutex> lock(capture.lock);
+    if (capture.head < number)
+        capture.writerWaits++;
+    while (capture.head < number)
+        capture.returned.wait(lock);
+}
+
+/* Map the buffer of a frame whose readback was queued earlier and hand it on */
+void collectCapture (long number)
+{
+    if (number < 0)
+        return;
+    CaptureFrame& frame = capture.frames[number % CAPTURE_BUFFERS];
+    if (!frame.pending || frame.number != number)
+        return;
+    frame.pending = false;
+    if (glClientWaitSync(frame.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        capture.fenceWaits++;
+        glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    }
+    glDeleteSync(frame.fence);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.buffers[number % CAPTURE_BUFFERS]);
+    frame.pixels = (const unsigned char*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame.width*frame.height*4, GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frame.mapped = frame.pixels != NULL;
+    if (!frame.mapped) {
+        // nothing to write: give the writer a blank frame rather than a gap in the numbers
+        frame.copy.assign(frame.width*frame.height*4, 0);
+        frame.pixels = &frame.copy[0];
+        capture.failures++;
+    }
+    handToWriter(number);
+}
+
+/* Unmap a buffer the writer is done with */
+void releaseCapture (int slot)
+{
+    CaptureFrame& frame = capture.frames[slot];
+    if (!frame.mapped)
+        return;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.buffers[slot]);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frame.mapped = false;
+}
+
+/* Pass the frames before 'end' still in flight on to the writer and wait
+   until they are written */
+void drainCapture (long end)
+{
+    for (long n=end-CAPTURE_LATENCY; n<end; n++)
+        collectCapture(n);
+    waitForWriter(end);
+    for (int i=0; i<CAPTURE_BUFFERS; i++)
+        releaseCapture(i);
+}
+
+/* Make the headless framebuffer draw into the target of frame 'number' */
+void attachCaptureTarget (long number)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, capture.targets[number % CAPTURE_BUFFERS]);
+    glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+}
+
+/* Queue the readback of the frame just drawn and hand on the one read
+   CAPTURE_LATENCY frames ago. Paused frames are not drawn, so not captured */
+void captureFrame (GLFWwindow* window)
+{
+    if (!capture.enabled || pause == 1)
+        return;
+    double start = wallClock();
+    int width = headless.width, height = headless.height;
+    if (window)
+        glfwGetFramebufferSize(window, &width, &height);
+    long number = capture.frame++;
+    int slot = number % CAPTURE_BUFFERS;
+    CaptureFrame& frame = capture.frames[slot];
+    // the buffer was last used CAPTURE_BUFFERS frames ago
+    waitForWriter(number - CAPTURE_BUFFERS + 1);
+    releaseCapture(slot);
+    frame.number = number;
+
+    // headless software frames are already in memory, bottom row first
+    if (capture.fromMemory) {
+        frame.copy.assign((const unsigned char*)&software.color[0],
+                          (const unsigned char*)&software.color[0] + software.width*software.height*4);
+        frame.pixels = &frame.copy[0];
+        frame.width = software.width;
+        frame.height = software.height;
+        handToWriter(number);
+        capture.loopSeconds += wallClock() - start;
+        return;
+    }
+
+    if (capture.sharedRead) {
+        frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        // the writer waits on the fence from its own context
+        glFlush();
+        frame.width = width;
+        frame.height = height;
+        handToWriter(number);
+        // draw the next frame into the next target, once the writer has read it
+        waitForWriter(number + 2 - CAPTURE_BUFFERS);
+        attachCaptureTarget(number + 1);
+        capture.loopSeconds += wallClock() - start;
+        return;
+    }
+
+    if (width != capture.width || height != capture.height) {
+        drainCapture(number);
+        capture.width = width;
+        capture.height = height;
+        for (int i=0; i<CAPTURE_BUFFERS; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.buffers[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, width*height*4, NULL, GL_STREAM_READ);
+        }
+        glstats.bufferUploads += CAPTURE_BUFFERS;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, renderScale.enabled ? renderScale.Output : screenFramebuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.buffers[slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame.width = width;
+    frame.height = height;
+    frame.pending = true;
+
+    collectCapture(number - CAPTURE_LATENCY);
+    capture.loopSeconds += wallClock() - start;
+}
+
+void printCaptureStats ()
+{
+    if (!capture.frame)
+        return;
+    printf("Capture: %ld frames written (%ld failed), %.3f ms per frame on the render loop, %.3f ms in the writer\n",
+           capture.written, capture.failures, 1000*capture.loopSeconds / capture.frame,
+           capture.written ? 1000*capture.writerSeconds / capture.written : 0.0);
+    printf("Capture waits: %ld on a fence, %ld on the writer\n", capture.fenceWaits, capture.writerWaits);
+}
+
+/* Write out the frames still in flight and stop the writer */
+void finishCapture ()
+{
+    if (!capture.enabled)
+        return;
+    double start = wallClock();
+    drainCapture(capture.frame);
+    capture.loopSeconds += wallClock() - start;
+    {
+        unique_lock<mutex> lock(capture.lock);
+        capture.stopping = true;
+    }
+    capture.ready.notify_one();
+    capture.writer.join();
+    if (capture.sharedRead) {
+        egl.DestroyContext(headless.display, capture.readContext);
+        // --dump and --golden read the last frame drawn
+        if (capture.frame)
+            attachCaptureTarget(capture.frame - 1);
+    }
+    if (capture.pipe)
+        pclose(capture.pipe);
+    capture.enabled = false;
+    printCaptureStats();
+}
+
+
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
     /* Objects should be created before any other gl function and shaders */
+    resetGLState();
 	// Create the models
   // Generate the VAO, VBOs, vertices data & copy into the array buffer
   //createRectangle (0,1.5,1,1.5,1,0,0,1,1);
@@ -1614,14 +4967,42 @@ void initGL (GLFWwindow* window, int width, int height)
   createRectangle(0,0,0.75,0.125,0.66,0.66,0.66,4,2);
   createRectangle(0,0,0.75,0.1125,0.66,0.66,0.66,4,3);
   createRectangle(0,0,0.75,0.1125,0.66,0.66,0.66,4,4);
-  createcircle(1,0.5,1,0.4,0.4,0,0);
-  createcircle(2,0.5,0.3,1,0.3,0,0);
-  //createcircle(3,0.125,0,0,1,0,0);
+  createUnitMeshes();
+  createInstanceRenderers();
+  createSpriteBatcher();
+  createStaticLayer();
+  createHUD();
+  createTransforms();
+  if(softwareRender)
+    createSoftwareRenderer();
+  createRenderScale();
+  startCapture();
+  // Fixed camera for 2D (ortho) in XY plane; updateCamera builds VP from it
+  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+  if(gpuFalling)
+    createFallingRenderer();
 
 	// Create and compile our GLSL program from the shaders
 	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
 	// Get a handle for our "MVP" uniform
 	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	registerProgram(programID);
+	char defines[128];
+	snprintf(defines, sizeof(defines), "#define INT16_POSITIONS\n#define POSITION_RANGE %f\n", POSITION_RANGE);
+	int16ProgramID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag", defines );
+	registerProgram(int16ProgramID);
+	if(gpuFalling)
+	{
+		snprintf(defines, sizeof(defines), "#define GPU_FALLING\n#define FALL_DROP %.9g\n", (float)perTick(0.4));
+		fallingProgramID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag", defines );
+		fallTicksID = glGetUniformLocation(fallingProgramID, "fallTicks");
+		registerProgram(fallingProgramID);
+	}
+	circleProgramID = LoadShaders( "Circle_GL.vert", "Circle_GL.frag" );
+	circleSemicircleID = glGetUniformLocation(circleProgramID, "semicircle");
+	registerProgram(circleProgramID);
+	// Instance scale used by draws that do not supply one (see Sample_GL.vert)
+	glVertexAttrib2f(3, 1, 1);
 
 
 	reshapeWindow (window, width, height);
@@ -1632,6 +5013,8 @@ void initGL (GLFWwindow* window, int width, int height)
 
 	glEnable (GL_DEPTH_TEST);
 	glDepthFunc (GL_LEQUAL);
+	// Used by the antialiased edges of drawCircle, which turns GL_BLEND on and off
+	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
@@ -1639,135 +5022,188 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* Command line options */
+void parseArguments (int argc, char** argv)
+{
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--int16-vertices"))
+            int16Vertices = true;
+        else if (!strcmp(argv[i], "--gpu-falling"))
+            gpuFalling = true;
+        else if (!strcmp(argv[i], "--software"))
+            softwareRender = true;
+        else if (!strcmp(argv[i], "--render-scale") && i+1 < argc) {
+            renderScale.enabled = true;
+            renderScale.percent = max(RENDER_SCALE_MIN, min(100, atoi(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--target-frame-time") && i+1 < argc) {
+            renderScale.enabled = true;
+            renderScale.target = atof(argv[++i])/1000;
+        }
+        else if (!strcmp(argv[i], "--pacing") && i+1 < argc) {
+            const char* name = argv[++i];
+            int mode = 0;
+            while (mode <= PACE_UNCAPPED && strcmp(name, pacingNames[mode]))
+                mode++;
+            if (mode > PACE_UNCAPPED) {
+                fprintf(stderr, "Unknown pacing mode %s (vsync, adaptive, cap or uncapped)\n", name);
+                exit(EXIT_FAILURE);
+            }
+            pacing.mode = (PacingMode)mode;
+            pacing.modeSet = true;
+        }
+        else if (!strcmp(argv[i], "--fps-cap") && i+1 < argc) {
+            pacing.mode = PACE_CAP;
+            pacing.modeSet = true;
+            pacing.capHz = max(1.0, atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--capture") && i+1 < argc)
+            capture.pattern = argv[++i];
+        else if (!strcmp(argv[i], "--capture-pipe") && i+1 < argc)
+            capture.pipeCommand = argv[++i];
+        else if (!strcmp(argv[i], "--shader-dir") && i+1 < argc)
+            shaderDirectory = argv[++i];
+        else if (!strcmp(argv[i], "--shader-cache") && i+1 < argc)
+            shaderCache.directory = argv[++i];
+        else if (!strcmp(argv[i], "--no-shader-cache"))
+            shaderCache.enabled = false;
+        else if (!strcmp(argv[i], "--tick-rate") && i+1 < argc)
+            sim.step = 1/max(1.0, atof(argv[++i]));
+        else if (!strcmp(argv[i], "--no-interpolation"))
+            interpolate = false;
+        else if (!strcmp(argv[i], "--collision-test"))
+            collisionTest = true;
+        else if (!strcmp(argv[i], "--pool-test"))
+            poolTest = true;
+        else if (!strcmp(argv[i], "--headless"))
+            headless.enabled = true;
+        else if (!strcmp(argv[i], "--frames") && i+1 < argc)
+            headless.frames = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--headless-rate") && i+1 < argc)
+            headless.step = 1/max(1.0, atof(argv[++i]));
+        else if (!strcmp(argv[i], "--dump") && i+1 < argc)
+            headless.dumpPath = argv[++i];
+        else if (!strcmp(argv[i], "--golden") && i+1 < argc)
+            headless.goldenPath = argv[++i];
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            fprintf(stderr, "Options:\n"
+                            "  --int16-vertices   store object positions as normalized int16\n"
+                            "  --gpu-falling      move the bricks in the vertex shader\n"
+                            "  --software         rasterize on the CPU instead of with GL\n"
+                            "  --render-scale N   render at N%% of the window size and scale up (25-100)\n"
+                            "  --target-frame-time MS  adjust the render scale to hold MS per frame\n"
+                            "  --pacing MODE      vsync (default), adaptive, cap or uncapped\n"
+                            "  --fps-cap N        wait for the wall clock to hold N frames per second\n"
+                            "  --capture FILE     write every frame to FILE, a name with %%d for the frame\n"
+                            "                     number ending in .ppm, .png or anything else for raw RGB\n"
+                            "  --capture-pipe CMD write every frame as raw RGB to the standard input of CMD\n"
+                            "  --shader-dir DIR   load the shaders from DIR instead of the built-in copies\n"
+                            "  --shader-cache DIR keep the linked program binaries in DIR instead of\n"
+                            "                     $XDG_CACHE_HOME/" SHADER_CACHE_NAME " or ~/.cache/" SHADER_CACHE_NAME "\n"
+                            "  --no-shader-cache  always compile the shaders, without reading or writing\n"
+                            "                     the program binaries\n"
+                            "  --tick-rate HZ     simulation ticks per second (60)\n"
+                            "  --no-interpolation draw the last tick instead of blending toward it\n"
+                            "  --collision-test   check the SIMD collision kernels against the scalar one and\n"
+                            "                     time them, then exit\n"
+                            "  --pool-test        check that pool handles survive removals and refuse\n"
+                            "                     removed entities, then exit\n"
+                            "  --headless         render offscreen without a window\n"
+                            "  --frames N         with --headless, quit after N frames (600)\n"
+                            "  --headless-rate HZ with --headless, simulated frames per second (60)\n"
+                            "  --dump FILE        with --headless, write the last frame as a PPM\n"
+                            "  --golden FILE      with --headless, fail unless the last frame matches FILE\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Headless frames are never presented, so there is no vsync to wait for
+    if (headless.enabled && (!pacing.modeSet || pacing.mode == PACE_VSYNC || pacing.mode == PACE_ADAPTIVE))
+        pacing.mode = PACE_UNCAPPED;
+}
+
 int main (int argc, char** argv)
 {
+    double startTime = wallClock();
+    parseArguments(argc, argv);
+    chooseCollisionKernel();
+    if (collisionTest) {
+        exit(testCollisionKernels() ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (poolTest) {
+        exit(testPools() ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 	int width = 1000;
 	int height = 1000;
   double x,y;
-     GLFWwindow* window = initGLFW(width, height);
+     GLFWwindow* window = NULL;
+     if (headless.enabled)
+       initHeadless(width, height);
+     else
+       window = initGLFW(width, height);
 
 	    initGL (window, width, height);
-      last_update_time=glfwGetTime();
-      fall_down_time=last_update_time;
-      shoot_time=last_update_time;
-      show_time=last_update_time;
-      bullet_update_time=last_update_time;
+      sim.lastClock=gameClock();
     /* Draw in loop */
-    while (!glfwWindowShouldClose(window)) {
+    while (headless.enabled ? headless.frame < headless.frames : !glfwWindowShouldClose(window)) {
 //return 0;
         // OpenGL Draw commands
         //score+=100;
         if(gameover==1)
         {
         cout<<"Your final score is "<<score<<endl;
-        return 0;
+        finishCapture();
+        stopSoftwareRenderer();
+        printGLStats();
+        return headless.enabled ? finishHeadless() : 0;
         }
+        // headless runs have no cursor: it rests in the middle of the screen
+        x=y=500;
+        if(!headless.enabled)
         glfwGetCursorPos(window,&x, &y);
         x=(x-500)/125;
         y=(500-y)/125;
-        draw(x,y);
+        advanceSimulation(x,y);
+        if(gameover==1)
+          continue;
+        long allocations = glstats.objectsCreated + glstats.bufferUploads;
+        double renderStart = headless.enabled ? wallClock() : 0;
+        draw();
+        captureFrame(window);
+        if(glstats.framesDrawn > 0 && glstats.objectsCreated + glstats.bufferUploads != allocations)
+          glstats.allocatingFrames++;
+        glstats.framesDrawn++;
+        endGLStateFrame();
+        if(headless.enabled)
+        {
+          glFinish();
+          headless.renderSeconds += wallClock() - renderStart;
+          headless.frame++;
+          paceFrame();
+        }
+        else
+        {
           // Swap Frame Buffer in double buffering
         glfwSwapBuffers(window);
+        paceFrame();
 
         // Poll for Keyboard and mouse events
         glfwPollEvents();
-
-      // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-      if(pause==0)
-        current_time = glfwGetTime(); // Time in seconds
-        if(fire==1 && current_time-shoot_time>=0.5 && pause==0)
+        }
+        if(glstats.framesDrawn == 1)
         {
-          shoot_time=current_time;
-          bulletend=(bulletend+1)%100;
-          bullets[bulletend][0]=-3.375+0.625*cos(laserpos[2]*5*M_PI/180.0f);
-          bullets[bulletend][1]=laserpos[1]+0.75+0.625*sin(laserpos[2]*5*M_PI/180.0f);
-          bullets[bulletend][2]=0.4;
-          bullets[bulletend][3]=0.05;
-          bullets[bulletend][4]=laserpos[2]*5;
-          collidedmirror[bulletend]=0;
-          system("mpg123 -vC sounds/1.mp3 &");
-          //createRectangle(0,0,0.4,0.05,1,1,0,7,bulletend);
+          // the first frame is on screen once the GPU is done with it
+          glFinish();
+          printf("Startup: %.1f ms to the first frame, %.1f ms of it in LoadShaders (%ld programs from the cache, %ld compiled)\n",
+                 1000*(wallClock() - startTime), 1000*shaderCache.seconds, shaderCache.loaded, shaderCache.compiled);
         }
-        if (current_time - last_update_time >=1 && pause==0) { // atleast 0.5s elapsed since last frame
-            // do something every 0.5 seconds ..
-            last_update_time = current_time;
-            int i;
-            srand(time(NULL));
-            int l,h;
-            float pos;
-            l=rand()%2;
-            if(l==0)
-            {
-              h=rand()%2;
-              srand(time(NULL));
-              pos=-2.392+1.224*((rand()%100)*1.0)/100;
-              leftend=(leftend+1)%100;
-              if(h==0)
-              {
-                if(current_time - black_create_time >=2)
-                {
-                black_create_time = current_time;
-                leftbrick[leftend][0]=0;
-                }
-                else
-                leftbrick[leftend][0]=1;
-                //br.color=0; //black
-              }
-              else
-              {
-                leftbrick[leftend][0]=1;
-                //br.color=1; //red
-              }
-              leftbrick[leftend][1]=pos;  //xpos
-              leftbrick[leftend][2]=4;  //ypos
-              leftbrick[leftend][3]=0.2;  //length
-              leftbrick[leftend][4]=0.6;  //width
-              leftvisit[leftend]=0;
-              // if(leftbrick[leftend][0]==0)
-              // {
-              // createRectangle(leftbrick[leftend][1],leftbrick[leftend][2],leftbrick[leftend][3],leftbrick[leftend][4],0,0,0,5,leftend);
-              // }
-              // else
-              // {
-              // createRectangle(leftbrick[leftend][1],leftbrick[leftend][2],leftbrick[leftend][3],leftbrick[leftend][4],1,0,0,5,leftend);
-              // }
-
-            }
-            else{
-              h=rand()%2;
-              srand(time(NULL));
-              pos=0.488+1.744*((rand()%100)*1.0)/100;
-              rightend=(rightend+1)%100;
-              if(h==0)
-              {
-                if(current_time - black_create_time>=2)
-                {
-                black_create_time=current_time;
-                rightbrick[rightend][0]=0;
-               }
-               else
-               rightbrick[rightend][0]=2;
-          //      br.color=0; //black
-              }
-              else
-              {
-                rightbrick[rightend][0]=2;
-                //br.color=1; //green
-              }
-              rightbrick[rightend][1]=pos;  //xpos
-              rightbrick[rightend][2]=4;  //ypos
-              rightbrick[rightend][3]=0.2;  //length
-              rightbrick[rightend][4]=0.6;  //width
-              rightvisit[rightend]=0;
-              // if(rightbrick[rightend][0]==0)
-              // createRectangle(rightbrick[rightend][1],rightbrick[rightend][2],rightbrick[rightend][3],rightbrick[rightend][4],0,0,0,6,rightend);
-              // else
-              // createRectangle(rightbrick[rightend][1],rightbrick[rightend][2],rightbrick[rightend][3],rightbrick[rightend][4],0,1,0,6,rightend);
-
-            }
 
-        }
     }
+    finishCapture();
+    stopSoftwareRenderer();
+    printGLStats();
+    if(headless.enabled)
+      return finishHeadless();
     glfwTerminate();
 //    exit(EXIT_SUCCESS);
 }